@@ -0,0 +1,49 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <stdint.h>
+#include <array>
+#include "poll_scheduler.hpp"
+
+/**
+ * @brief Result table of the benchmark firmware
+ *
+ * Every case adds one row. The table lives in RAM and is read with the
+ * debugger once the firmware reaches its final loop (`p bench::results`).
+ * Times are CPU cycles at Board::get_clk().
+ */
+namespace bench
+{
+    struct result_t
+    {
+        const char *name; // case name
+        uint32_t ops;     // operations done (records, reads, ...)
+        uint32_t bytes;   // payload bytes moved
+        uint32_t cycles;  // CPU cycles for the whole case
+        uint32_t extra;   // case specific (page programs, hits, ...)
+    };
+
+    inline std::array<result_t, 40> results;
+    inline uint32_t count;
+
+    inline void record(const char *name, uint32_t ops, uint32_t bytes, uint32_t cycles, uint32_t extra = 0)
+    {
+        if (count < results.size())
+        {
+            results[count++] = {name, ops, bytes, cycles, extra};
+        }
+    }
+
+    /**
+     * @brief run fn once and return the CPU cycles it took
+     */
+    template <typename F>
+    uint32_t measure(F &&fn)
+    {
+        const uint32_t start = cycles::now();
+        fn();
+        return cycles::now() - start;
+    }
+}
+
+#endif
@@ -0,0 +1,547 @@
+#include "Config.hpp"
+#include <array>
+#include "Board.hpp"
+#include "mpu.hpp"
+#include "pager.hpp"
+#include "bench.hpp"
+#include "write_combiner.hpp"
+#include "sector_rmw.hpp"
+#include "read_cache.hpp"
+#include "copy_engine.hpp"
+#include "recorder.hpp"
+#include "power_manager.hpp"
+#include "kv_store.hpp"
+#include "record_log.hpp"
+#ifdef BENCH_LFS
+#include "lfs_flash.hpp"
+#endif
+extern "C"
+{
+    int main();
+}
+
+/* the benchmarks own the last 512KB of the flash, single sector cases use the last sector */
+constexpr uint32_t bench_area = flash_size - 8 * sector_size;
+constexpr uint32_t scratch = flash_size - sector_size;
+
+static void halt()
+{
+    while (1)
+        ;
+}
+
+/**
+ * @brief append 16 bytes records, one page program per record vs write combining
+ */
+static void bench_append(FLASH_CLASS &flash)
+{
+    constexpr uint32_t rec_size = 16;
+    constexpr uint32_t rec_count = 1024;
+    std::array<uint8_t, rec_size> rec;
+    for (uint32_t i = 0; i < rec_size; i++)
+    {
+        rec[i] = static_cast<uint8_t>(i);
+    }
+
+    if (flash.erase_sector(reinterpret_cast<void *>(scratch)) != 0)
+    {
+        halt();
+    }
+    auto cyc = bench::measure([&]
+                              {
+        for (uint32_t i = 0; i < rec_count; i++)
+        {
+            flash.program_page(reinterpret_cast<void *>(scratch + i * rec_size), rec_size, rec.data());
+        } });
+    bench::record("append direct", rec_count, rec_count * rec_size, cyc, rec_count);
+
+    if (flash.erase_sector(reinterpret_cast<void *>(scratch)) != 0)
+    {
+        halt();
+    }
+    write_combiner<FLASH_CLASS> wc(flash, Board::get_clk() / 1000);
+    cyc = bench::measure([&]
+                         {
+        for (uint32_t i = 0; i < rec_count; i++)
+        {
+            wc.write(scratch + i * rec_size, rec_size, rec.data());
+        }
+        wc.flush(); });
+    bench::record("append combined", rec_count, rec_count * rec_size, cyc, wc.programs());
+}
+
+/**
+ * @brief rewrite 100 unaligned bytes inside a programmed sector
+ */
+static void bench_rmw(FLASH_CLASS &flash)
+{
+    constexpr uint32_t len = 100;
+    constexpr uint32_t rounds = 16;
+    std::array<uint8_t, len> data;
+    sector_rmw<FLASH_CLASS> rmw(flash);
+    auto cyc = bench::measure([&]
+                              {
+        for (uint32_t r = 0; r < rounds; r++)
+        {
+            data.fill(static_cast<uint8_t>(r * 0x11));
+            rmw.update(scratch + 0x1F83, len, data.data());
+        } });
+    bench::record("rmw unaligned", rounds, rounds * len, cyc, rmw.subsector_erases());
+}
+
+/**
+ * @brief reads of a small working set while a 4KB erase runs
+ */
+static void bench_cache(FLASH_CLASS &flash)
+{
+    constexpr uint32_t reads = 4096;
+    std::array<uint8_t, 32> buf;
+    read_cache<FLASH_CLASS> cache(flash);
+    /* warm up outside of the erased unit */
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        cache.read(scratch + i * 0x100, buf.size(), buf.data());
+    }
+    cache.reset_stats();
+    cache.erase(scratch + 0xF000, subsector_size, false);
+    auto cyc = bench::measure([&]
+                              {
+        for (uint32_t i = 0; i < reads; i++)
+        {
+            cache.read(scratch + (i % 8) * 0x100 + (i % 7) * 32, buf.size(), buf.data());
+        } });
+    flash.wait_ready();
+    bench::record("cache hits", reads, reads * buf.size(), cyc, cache.hits());
+}
+
+/**
+ * @brief copy the first half of the scratch sector to the second half
+ */
+static void bench_copy(FLASH_CLASS &flash)
+{
+    constexpr uint32_t half = sector_size / 2;
+    static copy_engine<FLASH_CLASS> engine(flash);
+    std::array<uint8_t, pg_size> page;
+    if (flash.erase_sector(reinterpret_cast<void *>(scratch)) != 0)
+    {
+        halt();
+    }
+    for (uint32_t p = 0; p < half; p += pg_size)
+    {
+        for (uint32_t i = 0; i < pg_size; i++)
+        {
+            page[i] = static_cast<uint8_t>(p / pg_size + i);
+        }
+        flash.program_page(reinterpret_cast<void *>(scratch + p), pg_size, page.data());
+    }
+    engine.copy(scratch + half, scratch, half);
+    /* 32KB copy well below the 32-bit range of the result table */
+    bench::record("copy 32KB", engine.stats().pages, engine.stats().bytes,
+                  static_cast<uint32_t>(engine.stats().cycles), engine.stats().erases);
+    /* the same copy again only compares */
+    engine.copy(scratch + half, scratch, half);
+    bench::record("copy 32KB again", engine.stats().pages, engine.stats().bytes,
+                  static_cast<uint32_t>(engine.stats().cycles), engine.stats().units_skipped);
+}
+
+/**
+ * @brief 64 bytes bursts every 0.5ms (128KB/s) recorded into 448KB
+ */
+static void bench_capture(FLASH_CLASS &flash)
+{
+    constexpr uint32_t burst = 64;
+    constexpr uint32_t period = Board::get_clk() / 2000;
+    static recorder<FLASH_CLASS, 0x8000> rec(flash, bench_area, 7 * sector_size);
+    std::array<uint8_t, burst> data;
+    data.fill(0x5A);
+    rec.reset();
+    uint32_t next = cycles::now();
+    uint32_t pushed = 0;
+    while (pushed + burst <= 6 * sector_size)
+    {
+        /* stands in for the sensor ISR */
+        if (static_cast<int32_t>(cycles::now() - next) >= 0)
+        {
+            rec.push(data.data(), burst);
+            pushed += burst;
+            next += period;
+        }
+        if (rec.service() != 0)
+        {
+            halt();
+        }
+    }
+    rec.finish();
+    const auto &st = rec.stats();
+    bench::record("capture 128KB/s", st.erases, st.bytes, static_cast<uint32_t>(st.cycles), st.max_occupancy);
+    bench::record("capture dropped", 0, st.dropped, 0, 0);
+}
+
+/**
+ * @brief wake from deep power-down to the first mapped read, against a full re-init
+ */
+static void bench_wake(FLASH_CLASS &flash)
+{
+    constexpr uint32_t rounds = 100;
+    power_manager<FLASH_CLASS> pm(flash, Board::get_clk() / 1000);
+    uint32_t total = 0;
+    pm.mmap();
+    for (uint32_t i = 0; i < rounds; i++)
+    {
+        pm.sleep();
+        pm.acquire();
+        total += pm.stats().last_wake;
+    }
+    pm.indirect();
+    bench::record("wake to read", rounds, 0, total, pm.stats().max_wake);
+
+    auto cyc = bench::measure([&]
+                              {
+        flash.init();
+        flash.mmap();
+        SCB_InvalidateDCache_by_Addr(reinterpret_cast<void *>(QSPI_BASE), 32);
+        (void)*reinterpret_cast<volatile const uint32_t *>(QSPI_BASE); });
+    flash.abort();
+    bench::record("re-init to read", 1, 0, cyc);
+}
+
+/**
+ * @brief put/get latency and mount time of the key-value store as it fills
+ */
+static void bench_kv(FLASH_CLASS &flash)
+{
+    static kv_store<FLASH_CLASS> kv(flash, bench_area, 32);
+    static constexpr const char *names[][3] = {
+        {"kv put 100", "kv get 100", "kv mount 100"},
+        {"kv put 300", "kv get 300", "kv mount 300"},
+        {"kv put 700", "kv get 700", "kv mount 700"},
+    };
+    constexpr std::array<uint32_t, 3> counts = {100, 300, 700};
+    std::array<uint8_t, 24> val;
+    if (kv.format() != 0)
+    {
+        halt();
+    }
+    uint32_t key = 0;
+    for (uint32_t n = 0; n < counts.size(); n++)
+    {
+        auto cyc = bench::measure([&]
+                                  {
+            for (; key < counts[n]; key++)
+            {
+                val.fill(static_cast<uint8_t>(key));
+                kv.put(key, val.data(), val.size());
+            } });
+        bench::record(names[n][0], counts[n], counts[n] * val.size(), cyc, kv.stats().gc_runs);
+        cyc = bench::measure([&]
+                             {
+            for (uint32_t k = 0; k < counts[n]; k++)
+            {
+                uint32_t len;
+                kv.get(k, val.data(), val.size(), len);
+            } });
+        bench::record(names[n][1], counts[n], counts[n] * val.size(), cyc);
+        cyc = bench::measure([&]
+                             { kv.mount(); });
+        bench::record(names[n][2], kv.count(), 0, cyc);
+    }
+}
+
+/**
+ * @brief record log: 16 byte records over a 4 sector ring, seek by key against a linear scan
+ */
+static void bench_log(FLASH_CLASS &flash)
+{
+    static record_log<FLASH_CLASS> log(flash, bench_area, 4);
+    constexpr uint32_t records = 20000;
+    constexpr uint32_t seeks = 1000;
+    std::array<uint8_t, 16> rec;
+    rec.fill(0x5A);
+    if (log.format() != 0)
+    {
+        halt();
+    }
+    auto cyc = bench::measure([&]
+                              {
+        for (uint32_t i = 0; i < records; i++)
+        {
+            log.append(i * 10, rec.data(), rec.size());
+        }
+        log.flush(); });
+    bench::record("log append 16B", records, records * rec.size(), cyc, log.sectors_used());
+    record_log<FLASH_CLASS>::cursor_t cur;
+    uint32_t key;
+    uint32_t len;
+    cyc = bench::measure([&]
+                         {
+        for (uint32_t i = 0; i < seeks; i++)
+        {
+            log.seek((i * 7919 % records) * 10, cur);
+            log.read(cur, key, rec.data(), rec.size(), len);
+        } });
+    bench::record("log seek", seeks, 0, cyc);
+    uint32_t scanned = 0;
+    cyc = bench::measure([&]
+                         {
+        log.seek(0, cur);
+        while ((log.read(cur, key, rec.data(), rec.size(), len) == 0) && (key < (records - 1) * 10))
+        {
+            scanned++;
+        } });
+    bench::record("log linear scan", 1, scanned * (rec.size() + 6), cyc, scanned);
+    cyc = bench::measure([&]
+                         { log.mount(); });
+    bench::record("log mount", 1, 0, cyc);
+    log.release();
+}
+
+/**
+ * @brief CRC-32 lookup table, built at compile time, read through the QSPI window
+ */
+static constexpr std::array<uint32_t, 256> make_crc_table()
+{
+    std::array<uint32_t, 256> table = {};
+    for (uint32_t i = 0; i < table.size(); i++)
+    {
+        uint32_t crc = i;
+        for (uint32_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (((crc & 1) != 0) ? 0xEDB88320 : 0);
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+__attribute__((section("external.rodata"))) static const std::array<uint32_t, 256> xip_table = make_crc_table();
+
+/**
+ * @brief XIP kernel, code and table executed from the QSPI window
+ */
+__attribute__((section("external"), noinline)) static uint32_t xip_kernel(const uint8_t *buf, uint32_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < size; i++)
+    {
+        crc = (crc >> 8) ^ xip_table[(crc ^ buf[i]) & 0xFF];
+    }
+    return ~crc;
+}
+
+/**
+ * @brief XIP code speed per MPU policy of the window: first call from cold caches (extra), then warm calls
+ */
+static void bench_xip(FLASH_CLASS &flash)
+{
+    struct case_t
+    {
+        const char *name;
+        bool mpu;
+        mpu::policy pol;
+    };
+    static constexpr std::array<case_t, 4> cases = {{
+        {"xip default map", false, mpu::WRITE_THROUGH},
+        {"xip write-through", true, mpu::WRITE_THROUGH},
+        {"xip write-back", true, mpu::WRITE_BACK},
+        {"xip non-cacheable", true, mpu::NON_CACHEABLE},
+    }};
+    constexpr uint32_t rounds = 100;
+    std::array<uint8_t, 1024> buf;
+    buf.fill(0x3C);
+    volatile uint32_t sink = 0;
+    if (flash.mmap() != 0)
+    {
+        halt();
+    }
+    for (const auto &c : cases)
+    {
+        if (c.mpu)
+        {
+            mpu::config_qspi(c.pol);
+        }
+        else
+        {
+            mpu::disable();
+        }
+        SCB_InvalidateICache();
+        SCB_InvalidateDCache_by_Addr(const_cast<uint32_t *>(xip_table.data()), sizeof(xip_table));
+        const uint32_t cold = bench::measure([&]
+                                             { sink = sink + xip_kernel(buf.data(), buf.size()); });
+        const uint32_t cyc = bench::measure([&]
+                                            {
+            for (uint32_t i = 0; i < rounds; i++)
+            {
+                sink = sink + xip_kernel(buf.data(), buf.size());
+            } });
+        bench::record(c.name, rounds, rounds * buf.size(), cyc, cold);
+    }
+    mpu::config_qspi();
+    if (flash.ensure_indirect() != 0)
+    {
+        halt();
+    }
+}
+
+/**
+ * @brief loads from the trapped window: page misses, emulated hits, the frame alias, hits during an erase
+ */
+static void bench_pager(FLASH_CLASS &flash)
+{
+    constexpr uint32_t loads = 1024;
+    constexpr uint32_t words = pager::page_size / sizeof(uint32_t);
+    constexpr uint32_t miss_pages = 2 * pager::frames;
+    const auto *win = reinterpret_cast<volatile const uint32_t *>(QSPI_BASE + bench_area);
+    /* the last page read stays resident */
+    const auto *hot = win + (miss_pages - 1) * words;
+    volatile uint32_t sink = 0;
+    pager::init(flash);
+    pager::enable();
+    auto cyc = bench::measure([&]
+                              {
+        for (uint32_t i = 0; i < miss_pages; i++)
+        {
+            sink = sink + win[i * words];
+        } });
+    bench::record("pager miss", miss_pages, miss_pages * pager::page_size, cyc, pager::stats().misses);
+    const uint32_t emulated = pager::stats().emulated;
+    cyc = bench::measure([&]
+                         {
+        for (uint32_t i = 0; i < loads; i++)
+        {
+            sink = sink + hot[i % words];
+        } });
+    bench::record("pager fault hit", loads, loads * sizeof(uint32_t), cyc, pager::stats().emulated - emulated);
+    const auto *alias = reinterpret_cast<const uint32_t *>(pager::map(bench_area + (miss_pages - 1) * pager::page_size));
+    if (alias == nullptr)
+    {
+        halt();
+    }
+    cyc = bench::measure([&]
+                         {
+        for (uint32_t i = 0; i < loads; i++)
+        {
+            sink = sink + alias[i % words];
+        } });
+    bench::record("pager map hit", loads, loads * sizeof(uint32_t), cyc);
+    /* the resident page keeps serving loads while the chip erases another unit */
+    if (flash.erase_subsector(reinterpret_cast<void *>(scratch), false) != 0)
+    {
+        halt();
+    }
+    cyc = bench::measure([&]
+                         {
+        for (uint32_t i = 0; i < loads; i++)
+        {
+            sink = sink + hot[i % words];
+        } });
+    bool busy = false;
+    if ((flash.is_busy(busy) != 0) || (flash.wait_ready() != 0))
+    {
+        halt();
+    }
+    bench::record("pager hit in erase", loads, loads * sizeof(uint32_t), cyc, busy ? 1 : 0);
+    pager::disable();
+}
+
+#ifdef BENCH_LFS
+/**
+ * @brief littlefs: 64KB file written and read in 256 bytes, small synced appends
+ */
+static void bench_lfs(FLASH_CLASS &flash)
+{
+    static lfs_flash<FLASH_CLASS> dev(flash, bench_area, 32 * subsector_size);
+    static lfs_t lfs;
+    static lfs_file_t file;
+    alignas(4) static uint8_t file_buf[pg_size];
+    const struct lfs_file_config file_cfg = {file_buf, nullptr, 0};
+    constexpr uint32_t file_size = 0x10000;
+    std::array<uint8_t, 256> chunk;
+    chunk.fill(0xA5);
+    if ((lfs_format(&lfs, dev.config()) != 0) || (lfs_mount(&lfs, dev.config()) != 0))
+    {
+        halt();
+    }
+    auto cyc = bench::measure([&]
+                              {
+        lfs_file_opencfg(&lfs, &file, "big", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC, &file_cfg);
+        for (uint32_t i = 0; i < file_size; i += chunk.size())
+        {
+            lfs_file_write(&lfs, &file, chunk.data(), chunk.size());
+        }
+        lfs_file_close(&lfs, &file); });
+    bench::record("lfs write 64KB", file_size / chunk.size(), file_size, cyc);
+    cyc = bench::measure([&]
+                         {
+        lfs_file_opencfg(&lfs, &file, "big", LFS_O_RDONLY, &file_cfg);
+        for (uint32_t i = 0; i < file_size; i += chunk.size())
+        {
+            lfs_file_read(&lfs, &file, chunk.data(), chunk.size());
+        }
+        lfs_file_close(&lfs, &file); });
+    bench::record("lfs read 64KB", file_size / chunk.size(), file_size, cyc);
+    constexpr uint32_t appends = 100;
+    cyc = bench::measure([&]
+                         {
+        lfs_file_opencfg(&lfs, &file, "log", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND, &file_cfg);
+        for (uint32_t i = 0; i < appends; i++)
+        {
+            lfs_file_write(&lfs, &file, chunk.data(), 32);
+            lfs_file_sync(&lfs, &file);
+        }
+        lfs_file_close(&lfs, &file); });
+    bench::record("lfs append 32B sync", appends, appends * 32, cyc);
+    cyc = bench::measure([&]
+                         {
+        lfs_unmount(&lfs);
+        lfs_mount(&lfs, dev.config()); });
+    bench::record("lfs remount", 1, 0, cyc);
+    lfs_unmount(&lfs);
+    dev.release();
+}
+#endif
+
+int main()
+{
+    SystemInit();
+    Board::rcc_config();
+    SCB_InvalidateICache();
+    SCB_InvalidateDCache();
+    SCB_EnableICache();
+    SCB_EnableDCache();
+    qspi_driver drv(QUADSPI);
+    FLASH_CLASS flash(drv);
+    drv.deinit();
+    Board::gpio_deinit();
+    Board::gpio_init();
+    drv.init(qspi_init);
+    FLASH_CLASS::scheduler::configure(Board::get_clk(), flash_clk);
+    FLASH_CLASS::set_stale_word(manifest_stale_word);
+    mpu::config_qspi();
+    if (flash.init() != 0)
+    {
+        halt();
+    }
+
+    bench_append(flash);
+    bench_rmw(flash);
+    bench_cache(flash);
+    bench_copy(flash);
+    bench_capture(flash);
+    bench_wake(flash);
+    bench_kv(flash);
+    bench_log(flash);
+#ifdef BENCH_LFS
+    bench_lfs(flash);
+#endif
+    bench_pager(flash);
+    bench_xip(flash);
+
+    if (flash.mmap() != 0)
+    {
+        halt();
+    }
+    while (1)
+    {
+        __NOP();
+    }
+}
@@ -0,0 +1,200 @@
+#include "Config.hpp"
+#include <array>
+#include "Board.hpp"
+#include "mpu.hpp"
+#include "xip.hpp"
+extern "C"
+{
+    int main();
+}
+
+/*
+ * XIP sweep: data read and instruction fetch speed of the memory mapped flash
+ * for every combination of prescaler, nCS timeout, continuous read, caches and
+ * MPU policy. Only reads the flash, the results go to xip::table.
+ */
+static constexpr std::array<uint8_t, 3> prescs = {presc, presc + 1, presc + 3};
+static constexpr std::array<uint16_t, 3> timeouts = {0, 4, 64};
+static constexpr std::array<uint32_t, 4> policies = {mpu::WRITE_THROUGH, mpu::WRITE_BACK, mpu::NON_CACHEABLE,
+                                                     xip::default_map};
+static_assert(prescs.size() * timeouts.size() * 2 * 2 * policies.size() == std::tuple_size_v<decltype(xip::table.row)>,
+              "one row per combination");
+
+/* data reads cover 1MB in the upper half of the flash, well past the code and any cache */
+constexpr uint32_t data_start = flash_size / 2;
+constexpr uint32_t seq_bytes = 0x10000;
+constexpr uint32_t rand_span = 0x100000;
+constexpr uint32_t rand_reads = 1024;
+static_assert(data_start + rand_span <= flash_size);
+/* twice the I-cache, a warm call still streams from the flash */
+constexpr uint32_t fetch_bytes = 0x8000;
+
+static std::array<uint32_t, rand_reads> rand_offsets;
+
+static void halt()
+{
+    while (1)
+        ;
+}
+
+/**
+ * @brief fetch_bytes of 16-bit adds, returns v + fetch_bytes / 2
+ */
+__attribute__((section("external"), naked, noinline)) static uint32_t xip_straight(uint32_t)
+{
+    __asm volatile(".rept 16384\n\t"
+                   "adds r0, r0, #1\n\t"
+                   ".endr\n\t"
+                   "bx lr");
+}
+
+static uint32_t read_seq()
+{
+    const auto *src = reinterpret_cast<volatile const uint32_t *>(QSPI_BASE + data_start);
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < seq_bytes / sizeof(uint32_t); i++)
+    {
+        sum += src[i];
+    }
+    return sum;
+}
+
+static uint32_t read_rand()
+{
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < rand_reads; i++)
+    {
+        sum += *reinterpret_cast<volatile const uint32_t *>(QSPI_BASE + data_start + rand_offsets[i]);
+    }
+    return sum;
+}
+
+template <typename F>
+static uint32_t measure(F &&fn)
+{
+    const uint32_t start = cycles::now();
+    fn();
+    return cycles::now() - start;
+}
+
+static void leave_mmap(FLASH_CLASS &flash)
+{
+    if (flash.ensure_indirect() != 0)
+    {
+        halt();
+    }
+}
+
+static void set_caches(bool on)
+{
+    if (on)
+    {
+        SCB_EnableICache();
+        SCB_EnableDCache();
+    }
+    else
+    {
+        SCB_DisableICache();
+        SCB_DisableDCache();
+    }
+}
+
+/**
+ * @brief measure one combination, the flash is memory mapped
+ */
+static void run(xip::row_t row)
+{
+    set_caches(row.cache != 0);
+    if (row.policy == xip::default_map)
+    {
+        mpu::disable();
+        SCB_InvalidateDCache_by_Addr(reinterpret_cast<void *>(QSPI_BASE), flash_size);
+        SCB_InvalidateICache();
+    }
+    else
+    {
+        mpu::config_qspi(static_cast<mpu::policy>(row.policy));
+    }
+    volatile uint32_t sink = 0;
+    row.seq = measure([&]
+                      { sink = sink + read_seq(); });
+    row.rand = measure([&]
+                       { sink = sink + read_rand(); });
+    /* the first call pulls the code once, the measured one runs past the I-cache */
+    sink = sink + xip_straight(0);
+    row.fetch = measure([&]
+                        { sink = sink + xip_straight(sink); });
+    xip::record(row);
+}
+
+int main()
+{
+    SystemInit();
+    Board::rcc_config();
+    SCB_InvalidateICache();
+    SCB_InvalidateDCache();
+    qspi_driver drv(QUADSPI);
+    FLASH_CLASS flash(drv);
+    drv.deinit();
+    Board::gpio_deinit();
+    Board::gpio_init();
+    drv.init(qspi_init);
+    FLASH_CLASS::scheduler::configure(Board::get_clk(), flash_clk);
+    mpu::config_qspi();
+    if (flash.init() != 0)
+    {
+        halt();
+    }
+
+    uint32_t x = 1;
+    for (auto &ofs : rand_offsets)
+    {
+        x = x * 1664525UL + 1013904223UL;
+        ofs = (x >> 8) & (rand_span - sizeof(uint32_t));
+    }
+    xip::table.row_words = sizeof(xip::row_t) / sizeof(uint32_t);
+    xip::table.cpu_hz = Board::get_clk();
+    xip::table.seq_bytes = seq_bytes;
+    xip::table.rand_reads = rand_reads;
+    xip::table.fetch_bytes = fetch_bytes;
+
+    for (auto p : prescs)
+    {
+        auto init = qspi_init;
+        init.presc = p;
+        drv.deinit();
+        drv.init(init);
+        for (auto t : timeouts)
+        {
+            for (uint32_t sioo = 0; sioo < 2; sioo++)
+            {
+                if (flash.mmap(sioo != 0, t) != 0)
+                {
+                    halt();
+                }
+                for (uint32_t cache = 0; cache < 2; cache++)
+                {
+                    for (auto pol : policies)
+                    {
+                        run({p, t, sioo, cache, pol, 0, 0, 0});
+                    }
+                }
+                leave_mmap(flash);
+            }
+        }
+    }
+    xip::table.magic = xip::magic;
+
+    drv.deinit();
+    drv.init(qspi_init);
+    set_caches(true);
+    mpu::config_qspi();
+    if (flash.mmap() != 0)
+    {
+        halt();
+    }
+    while (1)
+    {
+        __NOP();
+    }
+}
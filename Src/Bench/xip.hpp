@@ -0,0 +1,58 @@
+#ifndef XIP_HPP
+#define XIP_HPP
+
+#include <stdint.h>
+#include <array>
+
+/**
+ * @brief Result table of the XIP sweep firmware
+ *
+ * The table lives in RAM and only holds 32-bit words so a debugger script can
+ * dump it raw (`dump binary value xip.bin xip::table`, decoded by
+ * Tools/xipdump.py). The header is 8 words, rows follow with row_words words
+ * each. magic is written once the sweep is complete. Times are CPU cycles at
+ * cpu_hz.
+ */
+namespace xip
+{
+    constexpr uint32_t magic = 0x51504958; // "XIPQ"
+    constexpr uint32_t default_map = 3;    // policy of a row run with the MPU off
+
+    struct row_t
+    {
+        uint32_t presc;  // QUADSPI prescaler, flash clock = cpu_hz / 2 / (presc + 1)
+        uint32_t lptr;   // nCS release timeout in flash clocks, 0: TCEN off
+        uint32_t sioo;   // 1: continuous read, instruction sent once
+        uint32_t cache;  // 1: I- and D-cache enabled
+        uint32_t policy; // mpu::policy of the window, default_map: MPU off
+        uint32_t seq;    // cycles to read seq_bytes with sequential 32-bit loads
+        uint32_t rand;   // cycles for rand_reads 32-bit loads at random addresses
+        uint32_t fetch;  // cycles to execute fetch_bytes of straight-line code
+    };
+
+    struct table_t
+    {
+        uint32_t magic;
+        uint32_t row_words;
+        uint32_t rows; // rows filled
+        uint32_t cpu_hz;
+        uint32_t seq_bytes;
+        uint32_t rand_reads;
+        uint32_t fetch_bytes;
+        uint32_t reserved;
+        std::array<row_t, 144> row;
+    };
+    static_assert(sizeof(row_t) == 8 * sizeof(uint32_t) && sizeof(table_t) == (8 + 144 * 8) * sizeof(uint32_t));
+
+    inline table_t table;
+
+    inline void record(const row_t &row)
+    {
+        if (table.rows < table.row.size())
+        {
+            table.row[table.rows++] = row;
+        }
+    }
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "w25qxjv.hpp"
 #include "Board.hpp"
+#include <array>
 #if defined(W25Q64JV) || defined(W25Q32JV) || defined(W25Q16JV)
 
 #if defined(W25Q64JV)
@@ -16,10 +17,64 @@ using FLASH_CLASS = w25q16jv;
 #endif
 // AHB3 is 200MHz max, with 400MHz, it is divided by 2
 constexpr auto presc = qspi_driver::get_presc(Board::get_clk() / 2, FLASH_CLASS::get_max_clk());
+constexpr uint32_t flash_clk = Board::get_clk() / 2 / (presc + 1);
 constexpr uint32_t flash_size = FLASH_CLASS::get_size();
 constexpr uint32_t sector_size = FLASH_CLASS::get_sect_size();
+constexpr uint32_t subsector_size = FLASH_CLASS::get_subsect_size();
 constexpr uint32_t pg_size = FLASH_CLASS::get_pg();
 constexpr auto fsize = qspi_driver::get_fsize(flash_size);
+// Opt-in: sector_size makes the loaders keep per 4KB content hashes in the last sector
+// (Manifest.hpp), that sector is then no longer advertised to the debugger. Only safe when
+// every writer of the flash arms manifest_stale_word. 0 (default) gives the whole device.
+constexpr uint32_t manifest_size = 0;
+constexpr uint32_t manifest_start = flash_size - manifest_size;
+constexpr uint32_t device_size = manifest_start;
+// Firmware hands this to FLASH_CLASS::set_stale_word(): its first program/erase clears the
+// manifest header, the loaders then compare with the flash. The loaders leave it off.
+constexpr uint32_t manifest_stale_word = (manifest_size != 0) ? manifest_start : FLASH_CLASS::no_stale_word;
+struct sector_region_t
+{
+    uint32_t start; // offset in the flash, 64KB aligned
+    uint32_t size;  // multiple of 64KB
+};
+// Regions advertised to the debugger with 4KB sectors, everything else uses 64KB sectors.
+// {{0, flash_size}} exposes the 4KB granularity across the whole device.
+constexpr std::array<sector_region_t, 1> small_sector_regions = {{
+    {0x00000000, 0x00010000},
+}};
+/**
+ * @brief erase unit the loaders use at a flash offset
+ *
+ * @param offset offset in the flash
+ * @return constexpr uint32_t subsector_size inside small_sector_regions, sector_size otherwise
+ */
+constexpr uint32_t sector_size_at(uint32_t offset)
+{
+    for (const auto &region : small_sector_regions)
+    {
+        if ((offset >= region.start) && ((offset - region.start) < region.size))
+        {
+            return subsector_size;
+        }
+    }
+    return sector_size;
+}
+constexpr bool check_sector_regions()
+{
+    for (const auto &region : small_sector_regions)
+    {
+        if ((region.start % sector_size != 0) || (region.size % sector_size != 0) ||
+            (region.start + region.size > device_size))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(check_sector_regions(), "small_sector_regions must be 64KB aligned and inside the device");
+static_assert((manifest_size % sector_size) == 0, "manifest must be whole sectors");
+// Loader program/erase calls return before the flash finishes, the next call waits for BUSY
+constexpr bool deferred_completion = true;
 constexpr qspi_driver::init_t qspi_init = {
     presc, // prescaler
     4,     // threshold
@@ -0,0 +1,563 @@
+#ifndef __MANIFEST_HPP
+#define __MANIFEST_HPP
+
+#include <string.h>
+#include <array>
+#include "Config.hpp"
+#include "Session.hpp"
+
+/**
+ * @brief Per 4KB content hashes of the flash, lets the loaders skip unchanged units
+ *
+ * The manifest region (last sector, see Config.hpp) is a log of 8 bytes records
+ * after a 16 bytes header:
+ *
+ *   header : magic "MANQ", number of units, ~(magic ^ units), reserved
+ *   record : unit | (~unit << 16), CRC-32 of the unit (0xFFFFFFFF = unknown)
+ *
+ * The last record of a unit wins, a full log is compacted (erase, then the
+ * known hashes again). The table is kept in RAM between the loader calls.
+ *
+ * Inside an FLM program session erase requests are only recorded. When the
+ * data of a pending unit arrives it
+ * is staged with the rest of the unit as 0xFF, hashed with the CRC unit and
+ * compared with the manifest: an equal unit is neither read, erased nor
+ * programmed. Without a known hash (no or invalid manifest, unit written by
+ * other means) the staged unit is compared with the flash instead. A unit is
+ * marked unknown before it is erased or programmed, its new hash is recorded
+ * once it is programmed. commit() erases the pending units that got no data,
+ * the loaders call it before anything reads the flash and at the end of every
+ * session. Erases without a program phase to follow (FLM erase session, STLDR
+ * SectorErase) commit before returning, the loader RAM and with it the
+ * pending bits are gone by the next load.
+ *
+ * Hosts that erase in a session of their own (Keil and pyOCD erase under
+ * Init(1), CubeProgrammer's SectorErase) never leave an erase pending. Their
+ * erases record the units as blank, and a whole unit programmed onto a unit
+ * known to be blank gets its hash once the program completed. Only a later
+ * program session that erases the unit itself skips it.
+ *
+ * Firmware changing the flash arms FLASH_CLASS::set_stale_word() with
+ * manifest_stale_word: the driver clears the magic before its first program or
+ * erase, load() then finds no valid header and starts over. A writer that does
+ * not arm it (other firmware, a debugger writing the flash directly) leaves
+ * hashes behind that no longer match the flash, and a unit skipped on such a
+ * hash keeps the wrong content: the manifest is only safe when every writer
+ * arms the stale word.
+ */
+class flash_manifest
+{
+public:
+    static constexpr bool enabled = (manifest_size != 0);
+    static constexpr uint32_t unit = subsector_size;
+    static constexpr uint32_t units = enabled ? (device_size / unit) : 1;
+    static_assert(units <= 0x10000, "unit number does not fit the record tag");
+
+    struct stats_t
+    {
+        uint32_t skipped;    // units equal to the flash, not touched
+        uint32_t compared;   // units compared with the flash, no hash known
+        uint32_t erased;     // units erased
+        uint32_t programmed; // units erased/programmed after a mismatch
+    };
+
+    explicit flash_manifest(flash_session &session) : _session(session) {}
+
+    /**
+     * @brief record an erase request, the units are erased once their data is known
+     *
+     * @param offset flash offset, 4KB aligned
+     * @param size size, multiple of 4KB
+     * @return int 0 if successful, error otherwise
+     */
+    int erase(uint32_t offset, uint32_t size)
+    {
+        auto res = record_late();
+        for (uint32_t u = offset / unit; (res == 0) && (u < units) && (u * unit < offset + size); u++)
+        {
+            _state.pending[u / 32] |= 1UL << (u % 32);
+        }
+        return res;
+    }
+
+    /**
+     * @brief program data, units with a pending erase are resolved against the manifest
+     *
+     * A unit only partly covered by the call is resolved with the rest erased,
+     * data for the rest arriving later is programmed on top.
+     *
+     * @param offset flash offset
+     * @param size size of buf
+     * @param buf data
+     * @return int 0 if successful, error otherwise
+     */
+    int program(uint32_t offset, uint32_t size, const uint8_t *buf)
+    {
+        int res = 0;
+        while ((res == 0) && (size > 0))
+        {
+            res = record_late();
+            if (res != 0)
+            {
+                break;
+            }
+            const uint32_t u = offset / unit;
+            const uint32_t in = offset % unit;
+            const uint32_t len = (size < unit - in) ? size : (unit - in);
+            if ((u < units) && is_pending(u))
+            {
+                _stage.fill(0xFF);
+                memcpy(&_stage[in], buf, len);
+                res = resolve(u);
+            }
+            else
+            {
+                /* the hash of a whole unit programmed onto a blank one is recorded by the next call */
+                const bool whole = (u < units) && (len == unit) && (_state.table[u] == _state.blank);
+                const uint32_t crc = whole ? hash(buf, unit) : unknown;
+                res = forget(offset, len);
+                if (res == 0)
+                {
+                    res = _session.indirect();
+                }
+                if (res == 0)
+                {
+                    auto &flash = _session.flash();
+                    res = flash.program(reinterpret_cast<void *>(offset), len, const_cast<uint8_t *>(buf),
+                                        !deferred_completion);
+                    if (res != 0)
+                    {
+                        _session.invalidate();
+                    }
+                    else if (deferred_completion)
+                    {
+                        _session.defer();
+                    }
+                }
+                if ((res == 0) && whole)
+                {
+                    _state.late_unit = u;
+                    _state.late_hash = crc;
+                    /* without deferred completion the program is done */
+                    res = deferred_completion ? 0 : record_late();
+                }
+            }
+            offset += len;
+            buf += len;
+            size -= len;
+        }
+        return res;
+    }
+
+    /**
+     * @brief mark a range changed by other means (packed images), its units are unknown
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int forget(uint32_t offset, uint32_t size)
+    {
+        auto res = record_late();
+        for (uint32_t u = offset / unit; (res == 0) && (u < units) && (u * unit < offset + size); u++)
+        {
+            res = append(u, unknown);
+        }
+        return res;
+    }
+
+    /**
+     * @brief erase the pending units that got no data
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int commit()
+    {
+        if (_state.magic != valid_magic)
+        {
+            /* nothing recorded since the manifest was loaded */
+            return 0;
+        }
+        constexpr uint32_t per_sector = sector_size / unit;
+        int res = record_late();
+        for (uint32_t u = 0; (u < units) && (res == 0); u++)
+        {
+            if (!is_pending(u))
+            {
+                continue;
+            }
+            /* a sector pending as a whole goes with one sector erase */
+            uint32_t count = 1;
+            if (((u % per_sector) == 0) && (u + per_sector <= units))
+            {
+                while ((count < per_sector) && is_pending(u + count))
+                {
+                    count++;
+                }
+                count = (count == per_sector) ? count : 1;
+            }
+            res = erase_units(u, count);
+            u += count - 1;
+        }
+        return res;
+    }
+
+    /**
+     * @brief forget everything, after a chip erase
+     */
+    void drop() { _state.magic = 0; }
+
+    static const stats_t &stats() { return _state.stats; }
+
+    /**
+     * @brief worst case flash time of program() of size bytes, in microseconds
+     *
+     * Every unit touched is erased and programmed page by page between two log
+     * records, and one of the records may find the log full and compact it.
+     */
+    static constexpr uint32_t program_worst_us(uint32_t size)
+    {
+        const uint32_t touched = (size + unit - 1) / unit;
+        return touched * (traits::t_se_max + (unit / pg_size + 2) * traits::t_pp_max) + compact_worst_us;
+    }
+
+    /**
+     * @brief worst case flash time of erase() followed by commit(), in microseconds
+     */
+    static constexpr uint32_t erase_worst_us(uint32_t size)
+    {
+        const uint32_t touched = (size + unit - 1) / unit;
+        const uint32_t t_erase = (size < sector_size) ? traits::t_se_max : traits::t_be_max;
+        return t_erase + touched * 2 * traits::t_pp_max + compact_worst_us;
+    }
+
+private:
+    using traits = FLASH_CLASS::traits_t;
+    static constexpr uint32_t magic = 0x514E414D; // "MANQ"
+    static constexpr uint32_t valid_magic = 0x4D414E51;
+    static constexpr uint32_t unknown = 0xFFFFFFFF;
+    static constexpr uint32_t no_unit = 0xFFFFFFFF;
+    static constexpr uint32_t header_size = 16;
+    static constexpr uint32_t record_size = 8;
+    /* erase of the region, header and one record per unit */
+    static constexpr uint32_t compact_worst_us =
+        (manifest_size / sector_size) * traits::t_be_max +
+        (1 + (units * record_size + pg_size - 1) / pg_size) * traits::t_pp_max;
+
+    static const uint32_t *window(uint32_t offset) { return reinterpret_cast<const uint32_t *>(QSPI_BASE + offset); }
+
+    static bool is_erased(const uint32_t *word, uint32_t size)
+    {
+        for (uint32_t i = 0; i < size / 4; i++)
+        {
+            if (word[i] != 0xFFFFFFFF)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief CRC-32 (zlib) with the CRC unit, size multiple of 4
+     */
+    static uint32_t hash(const uint8_t *buf, uint32_t size)
+    {
+        RCC->AHB4ENR |= RCC_AHB4ENR_CRCEN;
+        (void)RCC->AHB4ENR;
+        CRC->POL = 0x04C11DB7;
+        CRC->INIT = 0xFFFFFFFF;
+        /* 32 bits polynomial, input reversed by word and output reversed: the reflected CRC */
+        CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_IN_1 | CRC_CR_REV_OUT | CRC_CR_RESET;
+        const uint32_t *word = reinterpret_cast<const uint32_t *>(buf);
+        for (uint32_t i = 0; i < size / 4; i++)
+        {
+            CRC->DR = word[i];
+        }
+        return ~CRC->DR;
+    }
+
+    bool is_pending(uint32_t u) const { return (_state.pending[u / 32] & (1UL << (u % 32))) != 0; }
+
+    void clear_pending(uint32_t u) { _state.pending[u / 32] &= ~(1UL << (u % 32)); }
+
+    /**
+     * @brief read the manifest once per session, a missing one is created empty
+     */
+    int load()
+    {
+        if (_state.magic == valid_magic)
+        {
+            return 0;
+        }
+        auto res = _session.mapped();
+        if (res != 0)
+        {
+            return res;
+        }
+        _state.table.fill(unknown);
+        _state.pending.fill(0);
+        _state.late_unit = no_unit;
+        _state.stats = {};
+        _stage.fill(0xFF);
+        _state.blank = hash(_stage.data(), unit);
+        /* the driver drops the lines it changes, the loader may have been reloaded since */
+        SCB_InvalidateDCache_by_Addr(reinterpret_cast<void *>(QSPI_BASE + manifest_start), manifest_size);
+        const uint32_t *hdr = window(manifest_start);
+        if ((hdr[0] != magic) || (hdr[1] != units) || (hdr[2] != ~(magic ^ units)))
+        {
+            res = format();
+        }
+        else
+        {
+            uint32_t pos = header_size;
+            for (; pos + record_size <= manifest_size; pos += record_size)
+            {
+                const uint32_t *rec = window(manifest_start + pos);
+                const uint32_t u = rec[0] & 0xFFFF;
+                if (rec[0] == 0xFFFFFFFF)
+                {
+                    break;
+                }
+                if (((rec[0] >> 16) == (~u & 0xFFFF)) && (u < units))
+                {
+                    _state.table[u] = rec[1];
+                }
+            }
+            _state.log_pos = pos;
+        }
+        if (res == 0)
+        {
+            _state.magic = valid_magic;
+        }
+        return res;
+    }
+
+    /**
+     * @brief erase the manifest and write an empty header, the RAM table is kept
+     */
+    int format()
+    {
+        auto res = _session.indirect();
+        auto &flash = _session.flash();
+        for (uint32_t off = 0; (res == 0) && (off < manifest_size); off += sector_size)
+        {
+            res = flash.erase(reinterpret_cast<void *>(manifest_start + off), sector_size);
+        }
+        std::array<uint32_t, header_size / 4> hdr = {magic, units, ~(magic ^ units), 0xFFFFFFFF};
+        if (res == 0)
+        {
+            res = flash.program(reinterpret_cast<void *>(manifest_start), header_size, hdr.data());
+        }
+        if (res != 0)
+        {
+            _session.invalidate();
+            return res;
+        }
+        _state.log_pos = header_size;
+        return 0;
+    }
+
+    /**
+     * @brief start over with the known hashes only
+     */
+    int compact()
+    {
+        auto res = format();
+        std::array<uint32_t, pg_size / 4> page;
+        uint32_t fill = 0;
+        for (uint32_t u = 0; (u <= units) && (res == 0); u++)
+        {
+            if ((u < units) && (_state.table[u] != unknown))
+            {
+                page[fill++] = u | (~u << 16);
+                page[fill++] = _state.table[u];
+            }
+            if ((fill == page.size()) || ((u == units) && (fill > 0)))
+            {
+                res = _session.flash().program(reinterpret_cast<void *>(manifest_start + _state.log_pos), fill * 4,
+                                               page.data());
+                _state.log_pos += fill * 4;
+                fill = 0;
+            }
+        }
+        if (res != 0)
+        {
+            _session.invalidate();
+        }
+        return res;
+    }
+
+    /**
+     * @brief load the manifest, record the hash of the unit the last program left running
+     *
+     * append() switches to indirect mode, which waits for that program first.
+     */
+    int record_late()
+    {
+        auto res = load();
+        if ((res != 0) || (_state.late_unit == no_unit))
+        {
+            return res;
+        }
+        const uint32_t u = _state.late_unit;
+        _state.late_unit = no_unit;
+        return append(u, _state.late_hash);
+    }
+
+    /**
+     * @brief record the hash of a unit, nothing is written if it did not change
+     */
+    int append(uint32_t u, uint32_t h)
+    {
+        if (_state.table[u] == h)
+        {
+            return 0;
+        }
+        auto res = _session.indirect();
+        if ((res == 0) && (_state.log_pos + record_size > manifest_size))
+        {
+            res = compact();
+        }
+        if (res != 0)
+        {
+            return res;
+        }
+        std::array<uint32_t, record_size / 4> rec = {u | (~u << 16), h};
+        res = _session.flash().program(reinterpret_cast<void *>(manifest_start + _state.log_pos), record_size,
+                                       rec.data());
+        if (res != 0)
+        {
+            _session.invalidate();
+            return res;
+        }
+        _state.log_pos += record_size;
+        _state.table[u] = h;
+        return 0;
+    }
+
+    /**
+     * @brief decide on a staged unit: skip it, or erase (if needed) and program it
+     */
+    int resolve(uint32_t u)
+    {
+        clear_pending(u);
+        const uint32_t adr = u * unit;
+        const uint32_t crc = hash(_stage.data(), unit);
+        bool same;
+        bool blank;
+        if (_state.table[u] != unknown)
+        {
+            /* no readback, the manifest knows the content */
+            same = (_state.table[u] == crc);
+            blank = (_state.table[u] == _state.blank);
+        }
+        else
+        {
+            auto res = _session.mapped();
+            if (res != 0)
+            {
+                return res;
+            }
+            same = (memcmp(window(adr), _stage.data(), unit) == 0);
+            blank = is_erased(window(adr), unit);
+            _state.stats.compared++;
+        }
+        if (same)
+        {
+            _state.stats.skipped++;
+            return append(u, crc);
+        }
+        auto res = append(u, unknown);
+        if (res == 0)
+        {
+            res = _session.indirect();
+        }
+        auto &flash = _session.flash();
+        if ((res == 0) && !blank)
+        {
+            res = flash.erase(reinterpret_cast<void *>(adr), unit);
+            _state.stats.erased++;
+        }
+        for (uint32_t p = 0; (res == 0) && (p < unit); p += pg_size)
+        {
+            if (!is_erased(reinterpret_cast<const uint32_t *>(&_stage[p]), pg_size))
+            {
+                res = flash.program(reinterpret_cast<void *>(adr + p), pg_size, &_stage[p]);
+            }
+        }
+        if (res != 0)
+        {
+            _session.invalidate();
+            return res;
+        }
+        _state.stats.programmed++;
+        return append(u, crc);
+    }
+
+    /**
+     * @brief erase pending units without data, blank ones are left alone
+     */
+    int erase_units(uint32_t first, uint32_t count)
+    {
+        bool blank = true;
+        for (uint32_t u = first; u < first + count; u++)
+        {
+            clear_pending(u);
+            if (_state.table[u] != unknown)
+            {
+                blank = blank && (_state.table[u] == _state.blank);
+            }
+            else if (blank)
+            {
+                auto res = _session.mapped();
+                if (res != 0)
+                {
+                    return res;
+                }
+                blank = is_erased(window(u * unit), unit);
+            }
+        }
+        int res = 0;
+        for (uint32_t u = first; (u < first + count) && (res == 0) && !blank; u++)
+        {
+            res = append(u, unknown);
+        }
+        if ((res == 0) && !blank)
+        {
+            res = _session.indirect();
+            if (res == 0)
+            {
+                res = _session.flash().erase(reinterpret_cast<void *>(first * unit), count * unit);
+            }
+            if (res != 0)
+            {
+                _session.invalidate();
+                return res;
+            }
+            _state.stats.erased += count;
+        }
+        for (uint32_t u = first; (u < first + count) && (res == 0); u++)
+        {
+            res = append(u, _state.blank);
+        }
+        return res;
+    }
+
+    struct state_t
+    {
+        uint32_t magic;                             // valid_magic once the table is loaded
+        uint32_t log_pos;                           // offset of the next record in the region
+        uint32_t blank;                             // hash of an erased unit
+        std::array<uint32_t, units> table;          // hash per unit, unknown if not known
+        std::array<uint32_t, (units + 31) / 32> pending; // erase requested, no data yet
+        uint32_t late_unit;                         // unit programmed whole onto blank, no_unit if none
+        uint32_t late_hash;                         // its hash, recorded once the program completed
+        stats_t stats;
+    };
+
+    /* like the session state: no startup code in the loaders, validity by magic */
+    inline static state_t _state;
+    alignas(4) inline static std::array<uint8_t, unit> _stage;
+    flash_session &_session;
+};
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef __SESSION_HPP
+#define __SESSION_HPP
+
+#include "Config.hpp"
+#include "Board.hpp"
+
+/**
+ * @brief Keeps the QSPI peripheral and the flash configured between loader calls
+ *
+ * begin() brings up the pins, the peripheral and the chip once per session, the
+ * entry points afterwards only switch the driver between indirect and memory
+ * mapped mode. The state is kept in static storage, a full bring up is only
+ * repeated when the state is lost (peripheral disabled, unknown RAM content) or
+ * after an error.
+ *
+ * With deferred completion a program or erase is only started, defer() records
+ * it and the next indirect()/mapped()/end() waits for BUSY first. A failure
+ * seen while waiting is kept until end() so the session still reports it, or
+ * until the next begin() for loaders without an end (STLDR has no UnInit).
+ */
+class flash_session
+{
+public:
+    flash_session() : _drv(QUADSPI), _flash(_drv) {}
+
+    /**
+     * @brief full bring up: pins, peripheral, chip reset and quad enable
+     *
+     * @return int 0 if successful, error otherwise, also when a deferred
+     * operation of the previous session failed and no end() reported it
+     */
+    int begin()
+    {
+        /* the error flag is only meaningful in a valid state, RAM is not initialized */
+        const bool valid = ready();
+        /* never reset the chip under a program/erase left by the previous session */
+        settle();
+        const bool failed = valid && _state.error;
+        _state.pending = false;
+        _state.error = false;
+        const auto res = restart();
+        return (res != 0) ? res : (failed ? 1 : 0);
+    }
+
+    /**
+     * @brief make sure the driver accepts indirect commands (program, erase)
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int indirect()
+    {
+        if (!ready())
+        {
+            return restart();
+        }
+        auto res = settle();
+        if (res != 0)
+        {
+            return res;
+        }
+        if (_flash.ensure_indirect() != 0)
+        {
+            return restart();
+        }
+        return 0;
+    }
+
+    /**
+     * @brief make sure the flash is visible in the memory mapped window
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int mapped()
+    {
+        if (!ready())
+        {
+            auto res = restart();
+            if (res != 0)
+            {
+                return res;
+            }
+        }
+        auto res = settle();
+        if (res != 0)
+        {
+            return res;
+        }
+        res = _flash.ensure_mapped();
+        if (res != 0)
+        {
+            invalidate();
+        }
+        return res;
+    }
+
+    /**
+     * @brief record a program/erase started without waiting for completion
+     */
+    void defer()
+    {
+        _state.pending = true;
+        FLASH_CLASS::scheduler::defer();
+    }
+
+    /**
+     * @brief wait for the operation recorded by defer()
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int settle()
+    {
+        if (!ready() || !_state.pending)
+        {
+            return 0;
+        }
+        _state.pending = false;
+        auto res = _flash.wait_ready();
+        if (res != 0)
+        {
+            _state.error = true;
+            invalidate();
+        }
+        return res;
+    }
+
+    /**
+     * @brief finish the last operation and release the peripheral and the pins
+     *
+     * @return int 0 if every operation of the session completed, error otherwise
+     */
+    int end()
+    {
+        settle();
+        const bool failed = _state.error;
+        _state.error = false;
+        invalidate();
+        _drv.deinit();
+        Board::gpio_deinit();
+        return failed ? 1 : 0;
+    }
+
+    /**
+     * @brief force a full bring up on the next call, used after a failed operation
+     */
+    void invalidate() { _state.magic = 0; }
+
+    FLASH_CLASS &flash() { return _flash; }
+
+private:
+    int restart()
+    {
+        _state.magic = 0;
+        _drv.deinit();
+        Board::gpio_deinit();
+        Board::gpio_init();
+        _drv.init(qspi_init);
+        FLASH_CLASS::scheduler::configure(Board::get_clk(), flash_clk);
+        auto res = _flash.init();
+        if (res != 0)
+        {
+            return res;
+        }
+        /* the quad reads and programs need QE, check that the chip took it */
+        res = _flash.quad_enabled(_state.quad_enabled);
+        if ((res != 0) || !_state.quad_enabled)
+        {
+            return (res != 0) ? res : 1;
+        }
+        _state.magic = valid_magic;
+        return 0;
+    }
+
+    struct state_t
+    {
+        uint32_t magic;           // valid_magic once begin() succeeded
+        bool quad_enabled;        // QE bit set in the chip
+        bool pending;             // program/erase started, BUSY not checked yet
+        bool error;               // a deferred operation failed during this session
+    };
+
+    bool ready() const
+    {
+        return (_state.magic == valid_magic) && _state.quad_enabled &&
+               ((RCC->AHB3ENR & RCC_AHB3ENR_QSPIEN) != 0) &&
+               ((QUADSPI->CR & QUADSPI_CR_EN) != 0);
+    }
+
+    static constexpr uint32_t valid_magic = 0x51535049; // "QSPI"
+    /* the loaders have no startup code, validity is tracked by magic instead of zero init */
+    inline static state_t _state;
+    qspi_driver _drv;
+    FLASH_CLASS _flash;
+};
+
+#endif
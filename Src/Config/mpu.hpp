@@ -0,0 +1,124 @@
+#ifndef __MPU_HPP
+#define __MPU_HPP
+
+#include "stm32h7xx.h"
+#include "Config.hpp"
+
+/**
+ * @brief MPU setup of the QSPI window
+ *
+ * The whole 256MB window is a strongly ordered, no access, execute never
+ * background region: neither code nor speculative reads reach past the flash
+ * (an access there stalls the QUADSPI, see the abort quirk). The mapped
+ * flash_size on top of it is normal memory with the chosen cache policy,
+ * read-only and executable. Without the MPU the default map treats the
+ * window as write-through cacheable memory over the full 256MB.
+ */
+namespace mpu
+{
+    enum policy
+    {
+        WRITE_THROUGH = 0, // cached, write-through, read allocate
+        WRITE_BACK,        // cached, write-back, read and write allocate
+        NON_CACHEABLE,     // normal memory, not cached
+    };
+
+    constexpr uint32_t qspi_window = 0x10000000;
+    constexpr uint32_t region_background = 0;
+    constexpr uint32_t region_flash = 1; // higher region numbers win where they overlap
+    constexpr uint32_t ap_none = 0;
+    constexpr uint32_t ap_read_only = 6;
+    static_assert(((flash_size & (flash_size - 1)) == 0) && (flash_size >= 32),
+                  "the flash must be a power of 2 to fit one MPU region");
+
+    /**
+     * @brief RASR SIZE field of a power of 2 region, size = 2^(field + 1)
+     */
+    constexpr uint32_t size_field(uint32_t size)
+    {
+        uint32_t field = 0;
+        while ((2UL << field) < size)
+        {
+            field++;
+        }
+        return field << MPU_RASR_SIZE_Pos;
+    }
+
+    /**
+     * @brief RASR TEX/C/B bits of a policy, not shareable
+     */
+    constexpr uint32_t attributes(policy pol)
+    {
+        switch (pol)
+        {
+        case WRITE_THROUGH:
+            return (1UL << MPU_RASR_C_Pos);
+        case WRITE_BACK:
+            return (1UL << MPU_RASR_TEX_Pos) | (1UL << MPU_RASR_C_Pos) | (1UL << MPU_RASR_B_Pos);
+        default:
+            return (1UL << MPU_RASR_TEX_Pos);
+        }
+    }
+
+    /**
+     * @brief program a region, the MPU must be disabled
+     */
+    inline void set_region(uint32_t region, uint32_t base, uint32_t rasr)
+    {
+        MPU->RNR = region;
+        MPU->RBAR = base;
+        MPU->RASR = rasr;
+    }
+
+    inline void disable()
+    {
+        __DMB();
+        MPU->CTRL = 0;
+        __DSB();
+        __ISB();
+    }
+
+    inline void enable()
+    {
+        /* privileged code keeps the default map outside the regions */
+        MPU->CTRL = MPU_CTRL_PRIVDEFENA_Msk | MPU_CTRL_ENABLE_Msk;
+        __DSB();
+        __ISB();
+    }
+
+    constexpr uint32_t background_rasr =
+        (1UL << MPU_RASR_XN_Pos) | (ap_none << MPU_RASR_AP_Pos) | size_field(qspi_window) | MPU_RASR_ENABLE_Msk;
+
+    /**
+     * @brief background and flash regions of the QSPI window, MPU enabled
+     *
+     * @param pol cache policy of the mapped flash
+     */
+    inline void config_qspi(policy pol = WRITE_THROUGH)
+    {
+        disable();
+        set_region(region_background, QSPI_BASE, background_rasr);
+        set_region(region_flash, QSPI_BASE,
+                   (ap_read_only << MPU_RASR_AP_Pos) | attributes(pol) | size_field(flash_size) | MPU_RASR_ENABLE_Msk);
+        enable();
+        /* lines cached under the previous attributes */
+        SCB_InvalidateDCache_by_Addr(reinterpret_cast<void *>(QSPI_BASE), flash_size);
+        SCB_InvalidateICache();
+    }
+
+    /**
+     * @brief the whole QSPI window no access, MPU enabled
+     *
+     * Every access to the flash takes a MemManage fault (pager.hpp).
+     * config_qspi() maps the flash again.
+     */
+    inline void block_qspi()
+    {
+        disable();
+        set_region(region_background, QSPI_BASE, background_rasr);
+        set_region(region_flash, QSPI_BASE, 0);
+        enable();
+    }
+}
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef __OVERLAY_HPP
+#define __OVERLAY_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+#include "stm32h7xx.h"
+
+/**
+ * @brief ITCM overlays of code stored in the QSPI flash
+ *
+ * The Test linker links code of the `.itcm` section and of the `.overlay0` to
+ * `.overlay3` sections to run in ITCM, 1KB past address 0, while its image is
+ * stored in the QSPI flash behind the `external` code. It emits a table of
+ * run address, load address and size per section: entry 0 is `.itcm`, copied
+ * once by init(), entries 1.. are the overlays. The overlays share one run
+ * address after `.itcm`, so only one of them is resident at a time.
+ *
+ * Overlay code is called through call<n>(), which loads the overlay first if
+ * another one took its place. Functions of `.itcm` are called directly once
+ * init() ran. The images are copied from the memory mapped window, the flash
+ * must be mapped while a section is loaded. The linker rejects references
+ * between overlays (NOCROSSREFS), overlay code must not use call<>() either.
+ *
+ * Interrupt handlers must not use call<>(): a load from a handler replaces
+ * the overlay of the code it preempted. call<>() stops in a loop when it
+ * runs in handler mode, when the load fails or when fn is not part of
+ * overlay n.
+ */
+struct overlay_entry_t
+{
+    uint32_t run;  // ITCM address the code is linked at
+    uint32_t load; // address of the image in the QSPI window
+    uint32_t size;
+};
+
+extern "C"
+{
+    extern const overlay_entry_t __overlay_table[];
+    extern const overlay_entry_t __overlay_table_end[];
+}
+
+namespace overlay
+{
+    constexpr uint32_t overlays = 4; // .overlay0 to .overlay3 in the linker script
+    constexpr uint32_t entries = overlays + 1;
+
+    struct stats_t
+    {
+        uint32_t loads;    // sections copied into ITCM
+        uint32_t bytes;    // bytes copied
+        uint32_t resident; // call<>() that found its overlay resident
+    };
+
+    namespace detail
+    {
+        inline bool resident[entries];
+        inline stats_t stats;
+
+        inline bool overlaps(const overlay_entry_t &a, const overlay_entry_t &b)
+        {
+            return (a.run < b.run + b.size) && (b.run < a.run + a.size);
+        }
+
+        /* the run range of overlay n holds adr, bit 0 of a Thumb function address is ignored */
+        inline bool contains(uint32_t n, uintptr_t adr)
+        {
+            const auto &ent = __overlay_table[n + 1];
+            adr &= ~static_cast<uintptr_t>(1);
+            return (adr >= ent.run) && (adr < ent.run + ent.size);
+        }
+
+        [[noreturn]] inline void stop()
+        {
+            while (1)
+                ;
+        }
+    }
+
+    inline uint32_t count() { return static_cast<uint32_t>(__overlay_table_end - __overlay_table); }
+
+    /**
+     * @brief copy a table entry into ITCM, whatever occupied its run range is no longer resident
+     *
+     * @param idx table entry, 0 is .itcm
+     * @return int 0 if successful, error otherwise
+     */
+    inline int load(uint32_t idx)
+    {
+        if (idx >= count())
+        {
+            return -1;
+        }
+        const auto &ent = __overlay_table[idx];
+        for (uint32_t i = 0; i < count(); i++)
+        {
+            if ((i != idx) && detail::overlaps(ent, __overlay_table[i]))
+            {
+                detail::resident[i] = false;
+            }
+        }
+        memcpy(reinterpret_cast<void *>(ent.run), reinterpret_cast<const void *>(ent.load), ent.size);
+        /* the copy went through the D-side, fetch the new code */
+        __DSB();
+        __ISB();
+        detail::resident[idx] = true;
+        detail::stats.loads++;
+        detail::stats.bytes += ent.size;
+        return 0;
+    }
+
+    /**
+     * @brief load the boot resident code of .itcm
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    inline int init() { return load(0); }
+
+    inline bool is_resident(uint32_t n) { return (n < overlays) && detail::resident[n + 1]; }
+
+    /**
+     * @brief make overlay n resident
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    inline int ensure(uint32_t n)
+    {
+        if (n >= overlays)
+        {
+            return -1;
+        }
+        if (detail::resident[n + 1])
+        {
+            detail::stats.resident++;
+            return 0;
+        }
+        return load(n + 1);
+    }
+
+    /**
+     * @brief veneer: call fn of overlay n once it is resident, thread mode only
+     */
+    template <uint32_t n, typename F, typename... A>
+    auto call(F *fn, A &&...args)
+    {
+        static_assert(n < overlays, "no such overlay in the linker script");
+        if ((__get_IPSR() != 0) || (ensure(n) != 0) || !detail::contains(n, reinterpret_cast<uintptr_t>(fn)))
+        {
+            detail::stop();
+        }
+        return fn(std::forward<A>(args)...);
+    }
+
+    inline const stats_t &stats() { return detail::stats; }
+}
+
+#endif
@@ -0,0 +1,31 @@
+#include "pager.hpp"
+
+extern "C"
+{
+    void MemManage_Handler() __attribute__((naked));
+    __attribute__((used)) uint32_t pager_fault(uint32_t *stacked, uint32_t *high);
+}
+
+uint32_t pager_fault(uint32_t *stacked, uint32_t *high) { return pager::fault(stacked, high) ? 0 : 1; }
+
+/**
+ * @brief hand the exception frame and r4-r11 to pager::fault()
+ *
+ * r4-r11 are saved below the frame so the emulated load can write them, they
+ * are restored from there. A fault the pager can not serve stops here, as the
+ * default handler does.
+ */
+void MemManage_Handler()
+{
+    __asm volatile("tst lr, #4\n\t"
+                   "ite eq\n\t"
+                   "mrseq r0, msp\n\t"
+                   "mrsne r0, psp\n\t"
+                   "push {r2, r4-r11, lr}\n\t" // r2 keeps the stack 8 byte aligned
+                   "add r1, sp, #4\n\t"
+                   "bl pager_fault\n\t"
+                   "cmp r0, #0\n\t"
+                   "1:\n\t"
+                   "bne 1b\n\t"
+                   "pop {r2, r4-r11, pc}");
+}
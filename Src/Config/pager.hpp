@@ -0,0 +1,441 @@
+#ifndef __PAGER_HPP
+#define __PAGER_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include "stm32h7xx.h"
+#include "Config.hpp"
+#include "mpu.hpp"
+
+/**
+ * @brief Demand paging of the flash while the driver is in indirect mode
+ *
+ * enable() makes the whole QSPI window no access. A load from the window
+ * takes a MemManage fault, the handler (pager.cpp) reads the 4KB page with
+ * the driver into a frame of the SRAM pool and completes the load from there.
+ * The Cortex-M7 cannot remap an address, so every load from the window traps
+ * and is emulated, resident pages included: LDR, LDRH, LDRB, LDRSH, LDRSB
+ * (16 and 32-bit encodings, immediate and register offset, writeback) and
+ * LDRD. Any other access (LDM, stores, code in the window) stays a fault.
+ * map() gives a direct alias of a resident page in its frame instead, read()
+ * copies ranges; both avoid the fault.
+ *
+ * A page table maps flash pages to frames, the least recently used frame is
+ * evicted. The driver reports every range it programs or erases, those pages
+ * are dropped. A miss is only served while the chip is idle: during a
+ * program/erase resident pages keep serving loads, a miss fails (read() and
+ * map() return an error, the fault handler stops). The foreground owns the
+ * operation and waits for it, the pager never does.
+ * Faults must not preempt a driver call (the QUADSPI is busy): only the code
+ * issuing the flash commands and interrupts that do not interrupt them may
+ * read the window.
+ */
+namespace pager
+{
+    constexpr uint32_t page_size = subsector_size;
+    constexpr uint32_t pages = flash_size / page_size;
+    constexpr uint32_t frames = 8;
+    constexpr uint8_t no_frame = 0xFF;
+    static_assert(frames < no_frame);
+
+    struct stats_t
+    {
+        uint32_t faults;    // MemManage faults on the window
+        uint32_t emulated;  // loads completed from a frame
+        uint32_t misses;    // pages read from the flash
+        uint32_t evictions; // resident pages replaced
+    };
+
+    namespace detail
+    {
+        constexpr uint32_t no_page = 0xFFFFFFFF;
+        constexpr uint8_t no_reg = 0xFF;
+
+        struct frame_t
+        {
+            uint32_t page;
+            uint32_t used; // access stamp, 0: free
+        };
+
+        /* a decoded load: size 8 reads two words into rt and rt2 */
+        struct load_t
+        {
+            uint32_t addr;
+            uint32_t wb_value;
+            uint8_t size;
+            bool sign;
+            uint8_t rt;
+            uint8_t rt2;
+            uint8_t wb; // base register written back
+            uint8_t len;
+        };
+
+        inline FLASH_CLASS *flash;
+        inline std::array<uint8_t, pages> table;
+        inline std::array<frame_t, frames> frame;
+        inline uint32_t clock;
+        inline stats_t stats;
+        alignas(32) inline std::array<std::array<uint8_t, page_size>, frames> pool __attribute__((section(".axisram")));
+
+        /**
+         * @brief frame holding a page, read from the flash on a miss
+         *
+         * @return uint8_t frame, no_frame if the page can not be read now
+         */
+        inline uint8_t load(uint32_t page)
+        {
+            if (flash == nullptr)
+            {
+                return no_frame;
+            }
+            uint8_t idx = table[page];
+            if (idx == no_frame)
+            {
+                /* a command in flight: the fault interrupted the driver */
+                if ((QUADSPI->SR & QUADSPI_SR_BUSY) != 0)
+                {
+                    return no_frame;
+                }
+                /* the chip reads nothing while it programs or erases, the fault must not wait for it */
+                bool busy = true;
+                if ((flash->is_busy(busy) != 0) || busy)
+                {
+                    return no_frame;
+                }
+                idx = 0;
+                for (uint8_t i = 1; i < frames; i++)
+                {
+                    if (frame[i].used < frame[idx].used)
+                    {
+                        idx = i;
+                    }
+                }
+                if (frame[idx].page != no_page)
+                {
+                    table[frame[idx].page] = no_frame;
+                    frame[idx] = {no_page, 0};
+                    stats.evictions++;
+                }
+                if (flash->read(reinterpret_cast<void *>(page * page_size), page_size, pool[idx].data()) != 0)
+                {
+                    return no_frame;
+                }
+                table[page] = idx;
+                frame[idx].page = page;
+                stats.misses++;
+            }
+            frame[idx].used = ++clock;
+            return idx;
+        }
+
+        inline uint32_t *reg(uint32_t *stacked, uint32_t *high, uint32_t n)
+        {
+            if (n < 4)
+            {
+                return &stacked[n];
+            }
+            if (n < 12)
+            {
+                return &high[n - 4];
+            }
+            if (n == 12)
+            {
+                return &stacked[4];
+            }
+            if (n == 14)
+            {
+                return &stacked[5];
+            }
+            return nullptr; // sp, pc
+        }
+
+        /**
+         * @brief decode the load at the stacked pc
+         *
+         * @return bool false if it is no supported load
+         */
+        inline bool decode(uint32_t *stacked, uint32_t *high, load_t &ld)
+        {
+            const auto *pc = reinterpret_cast<const uint16_t *>(stacked[6]);
+            const uint32_t hw1 = pc[0];
+            ld.rt2 = no_reg;
+            ld.wb = no_reg;
+            ld.sign = false;
+            if ((hw1 >> 11) < 0x1D)
+            {
+                ld.len = 2;
+                ld.rt = hw1 & 0x7;
+                const uint32_t rn = *reg(stacked, high, (hw1 >> 3) & 0x7);
+                const uint32_t imm5 = (hw1 >> 6) & 0x1F;
+                switch (hw1 >> 11)
+                {
+                case 0x0D: // LDR (immediate)
+                    ld.size = 4;
+                    ld.addr = rn + imm5 * 4;
+                    return true;
+                case 0x0F: // LDRB (immediate)
+                    ld.size = 1;
+                    ld.addr = rn + imm5;
+                    return true;
+                case 0x11: // LDRH (immediate)
+                    ld.size = 2;
+                    ld.addr = rn + imm5 * 2;
+                    return true;
+                default:
+                    break;
+                }
+                if ((hw1 >> 12) != 0x5)
+                {
+                    return false;
+                }
+                /* register offset */
+                ld.addr = rn + *reg(stacked, high, (hw1 >> 6) & 0x7);
+                switch ((hw1 >> 9) & 0x7)
+                {
+                case 3: // LDRSB
+                    ld.size = 1;
+                    ld.sign = true;
+                    return true;
+                case 4: // LDR
+                    ld.size = 4;
+                    return true;
+                case 5: // LDRH
+                    ld.size = 2;
+                    return true;
+                case 6: // LDRB
+                    ld.size = 1;
+                    return true;
+                case 7: // LDRSH
+                    ld.size = 2;
+                    ld.sign = true;
+                    return true;
+                default: // stores
+                    return false;
+                }
+            }
+
+            const uint32_t hw2 = pc[1];
+            ld.len = 4;
+            ld.rt = hw2 >> 12;
+            const uint32_t *rn = reg(stacked, high, hw1 & 0xF);
+            if ((rn == nullptr) || (reg(stacked, high, ld.rt) == nullptr))
+            {
+                return false;
+            }
+            if ((hw1 & 0xFE10) == 0xF810)
+            {
+                /* LDR, LDRB, LDRH, LDRSB, LDRSH */
+                static constexpr uint8_t sizes[4] = {1, 2, 4, 0};
+                ld.size = sizes[(hw1 >> 5) & 0x3];
+                ld.sign = (hw1 & 0x100) != 0;
+                if ((ld.size == 0) || (ld.sign && (ld.size == 4)))
+                {
+                    return false;
+                }
+                if ((hw1 & 0x80) != 0)
+                {
+                    ld.addr = *rn + (hw2 & 0xFFF);
+                }
+                else if ((hw2 & 0x800) != 0)
+                {
+                    /* imm8 with P, U, W */
+                    const uint32_t offset_addr = ((hw2 & 0x200) != 0) ? (*rn + (hw2 & 0xFF)) : (*rn - (hw2 & 0xFF));
+                    ld.addr = ((hw2 & 0x400) != 0) ? offset_addr : *rn;
+                    if ((hw2 & 0x100) != 0)
+                    {
+                        ld.wb = hw1 & 0xF;
+                        ld.wb_value = offset_addr;
+                    }
+                }
+                else if ((hw2 & 0xFC0) == 0)
+                {
+                    const uint32_t *rm = reg(stacked, high, hw2 & 0xF);
+                    if (rm == nullptr)
+                    {
+                        return false;
+                    }
+                    ld.addr = *rn + (*rm << ((hw2 >> 4) & 0x3));
+                }
+                else
+                {
+                    return false;
+                }
+                return true;
+            }
+            if (((hw1 & 0xFE50) == 0xE850) && ((hw1 & 0x120) != 0))
+            {
+                /* LDRD (immediate) */
+                ld.rt2 = (hw2 >> 8) & 0xF;
+                if (reg(stacked, high, ld.rt2) == nullptr)
+                {
+                    return false;
+                }
+                const uint32_t imm = (hw2 & 0xFF) * 4;
+                const uint32_t offset_addr = ((hw1 & 0x80) != 0) ? (*rn + imm) : (*rn - imm);
+                ld.size = 8;
+                ld.addr = ((hw1 & 0x100) != 0) ? offset_addr : *rn;
+                if ((hw1 & 0x20) != 0)
+                {
+                    ld.wb = hw1 & 0xF;
+                    ld.wb_value = offset_addr;
+                }
+                return true;
+            }
+            return false;
+        }
+
+        /**
+         * @brief step ITSTATE of the stacked xPSR past one instruction
+         */
+        inline void it_advance(uint32_t &xpsr)
+        {
+            uint32_t it = ((xpsr >> 8) & 0xFC) | ((xpsr >> 25) & 0x3);
+            it = ((it & 0x7) == 0) ? 0 : ((it & 0xE0) | ((it << 1) & 0x1F));
+            xpsr = (xpsr & ~((0x3FUL << 10) | (0x3UL << 25))) | ((it & 0xFC) << 8) | ((it & 0x3) << 25);
+        }
+    }
+
+    /**
+     * @brief copy a flash range through the frames
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    inline int read(uint32_t offset, uint32_t size, void *buf)
+    {
+        if ((offset > flash_size) || (size > flash_size - offset))
+        {
+            return -1;
+        }
+        auto *dst = static_cast<uint8_t *>(buf);
+        while (size > 0)
+        {
+            const uint8_t idx = detail::load(offset / page_size);
+            if (idx == no_frame)
+            {
+                return -1;
+            }
+            const uint32_t off = offset % page_size;
+            const uint32_t chunk = (size < page_size - off) ? size : (page_size - off);
+            memcpy(dst, detail::pool[idx].data() + off, chunk);
+            dst += chunk;
+            offset += chunk;
+            size -= chunk;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief alias of a flash offset in its frame
+     *
+     * Valid up to the end of the page, until the page is evicted or dropped.
+     *
+     * @return const uint8_t* nullptr if the page can not be loaded
+     */
+    inline const uint8_t *map(uint32_t offset)
+    {
+        if (offset >= flash_size)
+        {
+            return nullptr;
+        }
+        const uint8_t idx = detail::load(offset / page_size);
+        return (idx == no_frame) ? nullptr : detail::pool[idx].data() + (offset % page_size);
+    }
+
+    /**
+     * @brief forget the pages of a changed range
+     */
+    inline void drop(uint32_t offset, uint32_t size)
+    {
+        if ((size == 0) || (offset >= flash_size))
+        {
+            return;
+        }
+        const uint32_t last = ((size > flash_size - offset) ? (flash_size - 1) : (offset + size - 1)) / page_size;
+        for (uint32_t page = offset / page_size; page <= last; page++)
+        {
+            const uint8_t idx = detail::table[page];
+            if (idx != no_frame)
+            {
+                detail::table[page] = no_frame;
+                detail::frame[idx] = {detail::no_page, 0};
+            }
+        }
+    }
+
+    /**
+     * @brief register the flash, enable the MemManage fault
+     *
+     * The window stays as it is until enable().
+     */
+    inline void init(FLASH_CLASS &flash)
+    {
+        detail::table.fill(no_frame);
+        detail::frame.fill({detail::no_page, 0});
+        detail::clock = 0;
+        detail::stats = {};
+        detail::flash = &flash;
+        FLASH_CLASS::set_change_hook(drop);
+        SCB->SHCSR |= SCB_SHCSR_MEMFAULTENA_Msk;
+    }
+
+    /**
+     * @brief trap window accesses, the driver must be in indirect mode
+     */
+    inline void enable() { mpu::block_qspi(); }
+
+    /**
+     * @brief map the window again (mpu::config_qspi()), the frames stay valid
+     */
+    inline void disable() { mpu::config_qspi(); }
+
+    inline const stats_t &stats() { return detail::stats; }
+
+    /**
+     * @brief complete a faulting load from the frames
+     *
+     * @param stacked exception frame: r0-r3, r12, lr, pc, xPSR
+     * @param high r4-r11 of the faulting context, saved by the handler
+     * @return bool false if the fault is not a load from the flash that could be served
+     */
+    inline bool fault(uint32_t *stacked, uint32_t *high)
+    {
+        const uint32_t cfsr = SCB->CFSR;
+        if ((cfsr & SCB_CFSR_DACCVIOL_Msk) == 0)
+        {
+            return false;
+        }
+        detail::stats.faults++;
+        detail::load_t ld;
+        if (!detail::decode(stacked, high, ld) || (ld.addr < QSPI_BASE))
+        {
+            return false;
+        }
+        uint32_t val[2] = {0, 0};
+        if (read(ld.addr - QSPI_BASE, ld.size, val) != 0)
+        {
+            return false;
+        }
+        if (ld.sign)
+        {
+            val[0] = (ld.size == 1) ? static_cast<uint32_t>(static_cast<int8_t>(val[0]))
+                                    : static_cast<uint32_t>(static_cast<int16_t>(val[0]));
+        }
+        *detail::reg(stacked, high, ld.rt) = val[0];
+        if (ld.rt2 != detail::no_reg)
+        {
+            *detail::reg(stacked, high, ld.rt2) = val[1];
+        }
+        if (ld.wb != detail::no_reg)
+        {
+            *detail::reg(stacked, high, ld.wb) = ld.wb_value;
+        }
+        stacked[6] += ld.len;
+        detail::it_advance(stacked[7]);
+        SCB->CFSR = SCB_CFSR_MEMFAULTSR_Msk;
+        detail::stats.emulated++;
+        return true;
+    }
+}
+
+#endif
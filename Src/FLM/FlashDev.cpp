@@ -18,21 +18,65 @@
 
 #include "FlashOS.hpp"
 #include "Config.hpp"
+#include "Manifest.hpp"
 #define FLASH_DRV_VERS (0x0100 + VERS) // Driver Version, do not modify!
+#ifndef FLM_PAGE_SIZE
+#define FLM_PAGE_SIZE 0x1000 // Buffer size per ProgramPage call, split into flash pages by the driver
+#endif
+static_assert((FLM_PAGE_SIZE <= PAGE_MAX) && (FLM_PAGE_SIZE % pg_size == 0),
+              "FLM_PAGE_SIZE must be a multiple of the flash page and fit PAGE_MAX");
+using flash_traits = FLASH_CLASS::traits_t;
+// With deferred completion a call first waits for the erase the previous call left running,
+// a 64KB one at worst
+constexpr uint32_t settle_us = deferred_completion ? flash_traits::t_be_max : 0;
+// ProgramPage programs its flash pages, with the manifest it resolves the erase of the units
+// it covers and may compact the log. Plus margin, in ms.
+constexpr uint32_t prog_us = flash_manifest::enabled ? flash_manifest::program_worst_us(FLM_PAGE_SIZE)
+                                                     : (FLM_PAGE_SIZE / pg_size) * flash_traits::t_pp_max;
+constexpr uint32_t prog_timeout = 100 + (settle_us + prog_us) / 1000;
+// EraseSector only starts the erase, with the manifest outside a program phase it erases and
+// records the sector
+constexpr uint32_t erase_us = flash_manifest::enabled ? flash_manifest::erase_worst_us(sector_size) : 0;
+constexpr uint32_t erase_timeout = 1000 + (settle_us + erase_us) / 1000;
+
+/**
+ * @brief build the device description, one sector entry per change of sector size
+ *
+ * @return constexpr struct FlashDevice
+ */
+static constexpr struct FlashDevice make_device()
+{
+    struct FlashDevice dev = {};
+    const char name[] = FLASH_LDR_NAME;
+    static_assert(sizeof(name) <= NAME_MAX, "Device name too long");
+    for (uint32_t i = 0; i < sizeof(name); i++)
+    {
+        dev.devName[i] = name[i];
+    }
+    dev.vers = FLASH_DRV_VERS;         // Driver Version, do not modify!
+    dev.devType = EXTSPI;              // Device Type
+    dev.devAdr = QSPI_BASE;            // Device Start Address
+    dev.szDev = device_size;           // Device Size
+    dev.szPage = FLM_PAGE_SIZE;        // Programming Page Size
+    dev.res = 0x00000000;              // Reserved, must be 0
+    dev.valEmpty = 0xFF;               // Initial Content of Erased Memory
+    dev.toProg = prog_timeout;         // Program Page Timeout
+    dev.toErase = erase_timeout;       // Erase Sector Timeout
+    uint32_t entry = 0;
+    uint32_t current = 0;
+    for (uint32_t adr = 0; adr < device_size; adr += sector_size_at(adr))
+    {
+        if (sector_size_at(adr) != current)
+        {
+            current = sector_size_at(adr);
+            dev.sectors[entry++] = {current, adr};
+        }
+    }
+    dev.sectors[entry] = {SECTOR_END};
+    return dev;
+}
 
 extern "C"
 {
-    struct FlashDevice const FlashDevice __attribute__((section("DevDscr"))) = {
-        FLASH_DRV_VERS,             // Driver Version, do not modify!
-        FLASH_LDR_NAME,             // Device Name (128 chars max)
-        EXTSPI,                     // Device Type
-        QSPI_BASE,                  // Base Address                                                                                                                                                                                                                                                                                                                                                      ,                 // Device Start Address
-        flash_size,                 // Device Size
-        pg_size,                    // Programming Page Size
-        0x00000000,                 // Reserved, must be 0
-        0xFF,                       // Initial Content of Erased Memory
-        100,                        // Program Page Timeout 100 mSec
-        3000,                       // Erase Sector Timeout 3000 mSec
-        {{sector_size, 0x00000000}, // Sector Size {1kB, starting at address 0}
-         {SECTOR_END}}};
-}
\ No newline at end of file
+    constinit struct FlashDevice const FlashDevice __attribute__((section("DevDscr"))) = make_device();
+}
@@ -19,7 +19,8 @@
 #include "FlashOS.hpp"
 #include "FlashPrg.hpp"
 #include "Config.hpp"
-#include "Board.hpp"
+#include "Session.hpp"
+#include "Manifest.hpp"
 #include "watchdog.hpp"
 constexpr uint32_t flashOK = 0;
 constexpr uint32_t flashFail = 1;
@@ -31,10 +32,53 @@ enum operation
 };
 /* Quirks: having dummy data here to not optimize out the PrgData NOBITS*/
 volatile uint32_t dummydata __attribute__((section("PrgDataBss")));
+/* fnc of the running Init/UnInit pair: erases are only held back for a program phase */
+static uint32_t session_fnc;
 extern "C"
 {
   void SystemInit(void);
 }
+/**
+ * @brief check a memory mapped range against the erase pattern, one word at a time
+ *
+ * @param adr absolute address inside the QSPI window
+ * @param sz size of the range in bytes
+ * @param pat erased pattern
+ * @return true if every byte of the range equals pat
+ */
+static bool is_blank(uint32_t adr, uint32_t sz, uint8_t pat)
+{
+  /* lines cached before the last erase/program would hide the real content */
+  SCB_InvalidateDCache_by_Addr(reinterpret_cast<void *>(adr), static_cast<int32_t>(sz));
+  const uint32_t pat_word = 0x01010101UL * pat;
+  auto byte_ptr = reinterpret_cast<const volatile uint8_t *>(adr);
+  while ((sz > 0) && ((reinterpret_cast<uint32_t>(byte_ptr) & 0x3) != 0))
+  {
+    if (*byte_ptr++ != pat)
+    {
+      return false;
+    }
+    sz--;
+  }
+  auto word_ptr = reinterpret_cast<const volatile uint32_t *>(byte_ptr);
+  for (; sz >= sizeof(uint32_t); sz -= sizeof(uint32_t))
+  {
+    if (*word_ptr++ != pat_word)
+    {
+      return false;
+    }
+  }
+  byte_ptr = reinterpret_cast<const volatile uint8_t *>(word_ptr);
+  while (sz-- > 0)
+  {
+    if (*byte_ptr++ != pat)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
 int Init(uint32_t adr, uint32_t clk, uint32_t fnc)
 {
   // Called to configure the SoC. Should enable clocks
@@ -51,28 +95,29 @@ int Init(uint32_t adr, uint32_t clk, uint32_t fnc)
   SCB_EnableDCache();
   Board::rcc_config();
   __disable_irq();
-  qspi_driver drv(QUADSPI);
-  FLASH_CLASS flash(drv);
-  drv.deinit();
-  Board::gpio_deinit();
-  Board::gpio_init();
-  drv.init(qspi_init);
-  int res = flash.init();
-  if (res != 0)
+  flash_session session;
+  if (session.begin() != 0)
   {
     return flashFail;
   }
+  session_fnc = fnc;
+  if (flash_manifest::enabled)
+  {
+    /* erases a failed UnInit left behind, then reload the manifest */
+    flash_manifest manifest(session);
+    if (manifest.commit() != 0)
+    {
+      return flashFail;
+    }
+    manifest.drop();
+  }
   if (fnc != PROGRAM)
   {
-    if (flash.mmap() != 0)
+    if (session.mapped() != 0)
     {
       return flashFail;
     }
   }
-
-  /* Quirks: Trigger Read access, otherwise abort will stuck */
-  // uint32_t a = *(uint32_t *)(QSPI_BASE);
-  // a++;
   return flashOK;
 }
 
@@ -83,35 +128,29 @@ int UnInit(uint32_t fnc)
   //  Fnc parameter has meaning but isnt used in MSC program
   //  routines
   (void)fnc;
-  qspi_driver drv(QUADSPI);
-  // get drv ref
-  drv.deinit();
-  Board::gpio_deinit();
+  flash_session session;
+  /* held back erases that got no data, nothing is left for a later session */
+  const int committed = flash_manifest::enabled ? flash_manifest(session).commit() : 0;
+  /* final check of the last deferred program/erase */
+  const int res = session.end() | committed;
   __enable_irq();
   SCB_DisableICache();
   SCB_DisableDCache();
-  return flashOK;
+  return (res == 0) ? flashOK : flashFail;
 }
 
 int EraseChip(void)
 {
   // Execute a sequence that erases the entire of flash memory region
-  int res;
-  qspi_driver drv(QUADSPI);
-  FLASH_CLASS flash(drv);
-  drv.deinit();
-  Board::gpio_deinit();
-  Board::gpio_init();
-  drv.init(qspi_init);
-  res = flash.init();
-  if (res != 0)
+  flash_session session;
+  if (session.indirect() != 0)
   {
     return flashFail;
   }
-  drv.init(qspi_init);
-  res = flash.erase_chip();
-  if (res != 0)
+  flash_manifest(session).drop();
+  if (session.flash().erase_chip() != 0)
   {
+    session.invalidate();
     return flashFail;
   }
   return flashOK;
@@ -120,25 +159,47 @@ int EraseChip(void)
 int EraseSector(uint32_t adr)
 {
   // Execute a sequence that erases the sector that adr resides in
-  adr -= QSPI_BASE;
-  int res;
-  qspi_driver drv(QUADSPI);
-  FLASH_CLASS flash(drv);
-  drv.deinit();
-  Board::gpio_deinit();
-  Board::gpio_init();
-  drv.init(qspi_init);
-  res = flash.init();
-  if (res != 0)
+  flash_session session;
+  if (session.mapped() != 0)
   {
     return flashFail;
   }
-  res = flash.erase_sector(reinterpret_cast<void *>(adr));
-  if (res != 0)
+  /* 4KB or 64KB, as advertised in FlashDev.cpp */
+  const uint32_t size = sector_size_at(adr - QSPI_BASE);
+  adr &= ~(size - 1);
+  if (flash_manifest::enabled)
   {
+    /* in a program phase it is carried out once the data of the sector is known, unchanged
+       units are skipped; without a program phase to follow it is carried out now */
+    flash_manifest manifest(session);
+    if ((manifest.erase(adr - QSPI_BASE, size) != 0) || ((session_fnc != PROGRAM) && (manifest.commit() != 0)))
+    {
+      return flashFail;
+    }
+    return flashOK;
+  }
+  /* Already erased sectors (factory fresh parts, re-flashing a partial image) are skipped */
+  if (is_blank(adr, size, 0xFF))
+  {
+    return flashOK;
+  }
+  if (session.indirect() != 0)
+  {
+    return flashFail;
+  }
+  adr -= QSPI_BASE;
+  if (session.flash().erase(reinterpret_cast<void *>(adr), size, !deferred_completion) != 0)
+  {
+    session.invalidate();
     return flashFail;
   }
-  if (flash.mmap() != 0)
+  if (deferred_completion)
+  {
+    /* the next call waits for the erase to finish */
+    session.defer();
+    return flashOK;
+  }
+  if (session.mapped() != 0)
   {
     return flashFail;
   }
@@ -147,31 +208,47 @@ int EraseSector(uint32_t adr)
 
 int ProgramPage(uint32_t adr, uint32_t sz, uint8_t *buf)
 {
-  // Program the contents of buf starting at adr for length of sz
+  // Program the contents of buf starting at adr for length of sz,
+  //  sz can be up to the szPage advertised in FlashDev.cpp
   adr -= QSPI_BASE;
-  qspi_driver drv(QUADSPI);
-  FLASH_CLASS flash(drv);
+  flash_session session;
+  if (flash_manifest::enabled)
+  {
+    return (flash_manifest(session).program(adr, sz * sizeof(*buf), buf) == 0) ? flashOK : flashFail;
+  }
+  if (session.indirect() != 0)
+  {
+    return flashFail;
+  }
   const auto destAddr = reinterpret_cast<void *>(adr);
-  if (flash.program_page(destAddr, sz * sizeof(*buf), buf) != 0)
+  if (session.flash().program(destAddr, sz * sizeof(*buf), buf, !deferred_completion) != 0)
   {
+    session.invalidate();
     return flashFail;
   }
+  if (deferred_completion)
+  {
+    /* the next buffer is transferred while the last page is programmed */
+    session.defer();
+  }
   return flashOK;
 }
 
-// int BlankCheck(uint32_t adr, uint32_t sz, uint8_t pat)
-// {
-//   // Check that the memory at address adr for length sz is
-//   // empty or the same as pat
-//   qspi_driver drv(QUADSPI);
-//   FLASH_CLASS flash(drv);
-//   adr -= QSPI_BASE;
-//   if (flash.blank_check(reinterpret_cast<void *>(adr), sz, pat) != 0)
-//   {
-//     return flashFail;
-//   }
-//   return flashOK;
-// }
+int BlankCheck(uint32_t adr, uint32_t sz, uint8_t pat)
+{
+  // Check that the memory at address adr for length sz is
+  // empty or the same as pat
+  flash_session session;
+  if (flash_manifest::enabled && (flash_manifest(session).commit() != 0))
+  {
+    return flashFail;
+  }
+  if (session.mapped() != 0)
+  {
+    return flashFail;
+  }
+  return is_blank(adr, sz, pat) ? flashOK : flashFail;
+}
 
 // uint32_t Verify(uint32_t adr, uint32_t sz, uint8_t *buf)
 // {
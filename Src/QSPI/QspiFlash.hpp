@@ -2,21 +2,40 @@
 #define FLASH_NOR_HPP
 
 #include "qspi.hpp"
-class QspiFlash
-{
-protected:
-    qspi_driver &_drv;
+#include <concepts>
 
-public:
-    virtual int program_page(void *dest, uint32_t size, void *src) { return 1; }
-    virtual uint32_t verify(void *dest, uint32_t size, void *src) { return 0; }
-    virtual int blank_check(void *dest, uint32_t size, uint8_t data) { return 1; }
-    virtual int erase_sector(void *adr) { return 1; }
-    virtual int erase_chip() { return 1; }
-    virtual int read(void *dest, uint32_t size, void *buff) { return 1; }
-    int abort() { return _drv.abort(); }
-    virtual int mmap() { return 1; }
-    QspiFlash(qspi_driver &drv) : _drv(drv) {}
+/**
+ * @brief Interface every QSPI NOR driver provides to the loaders and the flash services
+ *
+ * Checked at compile time, calls are statically dispatched and can be inlined
+ * (no vtable, no GOT indirection in the position independent FLM).
+ */
+template <typename T>
+concept QspiFlash = requires(T flash, void *adr, uint32_t size, void *buf, uint8_t pat, bool wait,
+                             const qspi_driver::segment_t *segs, bool &busy) {
+    { flash.init() } -> std::same_as<int>;
+    { flash.program_page(adr, size, buf, wait) } -> std::same_as<int>;
+    { flash.program_page(adr, segs, size, wait) } -> std::same_as<int>;
+    { flash.program(adr, size, buf, wait) } -> std::same_as<int>;
+    { flash.verify(adr, size, buf) } -> std::same_as<uint32_t>;
+    { flash.blank_check(adr, size, pat) } -> std::same_as<int>;
+    { flash.erase_sector(adr, wait) } -> std::same_as<int>;
+    { flash.erase_subsector(adr, wait) } -> std::same_as<int>;
+    { flash.erase(adr, size, wait) } -> std::same_as<int>;
+    { flash.erase_chip() } -> std::same_as<int>;
+    { flash.wait_ready() } -> std::same_as<int>;
+    { flash.is_busy(busy) } -> std::same_as<int>;
+    { flash.read(adr, size, buf) } -> std::same_as<int>;
+    { flash.abort() } -> std::same_as<int>;
+    { flash.mmap() } -> std::same_as<int>;
+    { flash.ensure_mapped() } -> std::same_as<int>;
+    { flash.ensure_indirect() } -> std::same_as<int>;
+    { T::is_mapped() } -> std::same_as<bool>;
+    { T::get_size() } -> std::same_as<uint32_t>;
+    { T::get_pg() } -> std::same_as<uint32_t>;
+    { T::get_sect_size() } -> std::same_as<uint32_t>;
+    { T::get_subsect_size() } -> std::same_as<uint32_t>;
+    { T::get_max_clk() } -> std::same_as<uint32_t>;
 };
 
-#endif
\ No newline at end of file
+#endif
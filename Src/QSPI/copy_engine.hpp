@@ -0,0 +1,280 @@
+#ifndef COPY_ENGINE_HPP
+#define COPY_ENGINE_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include "QspiFlash.hpp"
+#include "poll_scheduler.hpp"
+
+/**
+ * @brief Flash to flash copy inside the same chip (slot promotion, compaction)
+ *
+ * The copy runs in 4KB units. Each unit of the source and of the destination
+ * is read with one burst into a RAM buffer each, then the destination is
+ * only touched where needed:
+ *   - identical unit: nothing to do
+ *   - only bits to clear: pages programmed over the old content
+ *   - otherwise: the unit is erased first
+ * A destination sector the copy covers completely is compared first, when at
+ * least a quarter of its units need an erase it gets one 64KB erase (the W25Q
+ * takes about as long for it as for 3-4 4KB erases) and its pages are then
+ * programmed onto the blank sector. The partial sectors at the edges keep the
+ * 4KB erases. Pages that are all 0xFF are not programmed. Every command is started
+ * without waiting, the next comparison runs while the chip is busy and the
+ * bus is only used again once BUSY is clear (the chip accepts no read while
+ * it programs or erases).
+ *
+ * There is no double buffering and no erase ahead: with a single chip the
+ * read of the next unit can not overlap the program of the current one, and
+ * an erase ahead would block the reads of the unit it precedes. The overlap
+ * is limited to the CPU work.
+ *
+ * The destination must be 4KB aligned and must not overlap the source. The
+ * bytes following the copy in its last destination unit are preserved.
+ */
+template <QspiFlash flash_t>
+class copy_engine
+{
+public:
+    struct stats_t
+    {
+        uint32_t bytes;          // bytes copied
+        uint64_t cycles;         // CPU cycles of the last copy()
+        uint32_t erases;         // 4KB units erased
+        uint32_t sector_erases;  // 64KB sectors erased
+        uint32_t units_skipped;  // units already holding the data
+        uint32_t pages;          // pages programmed
+        uint32_t pages_skipped;  // pages left alone (blank or unchanged)
+    };
+
+    copy_engine(flash_t &flash) : _flash(flash) {}
+
+    /**
+     * @brief copy a range inside the flash
+     *
+     * @param dst destination flash offset, 4KB aligned
+     * @param src source flash offset
+     * @param size number of bytes
+     * @return int 0 if successful, error otherwise
+     */
+    int copy(uint32_t dst, uint32_t src, uint32_t size)
+    {
+        if (((dst % unit) != 0) || ((dst < src + size) && (src < dst + size)))
+        {
+            return 1;
+        }
+        _stats = {};
+        int res = 0;
+        /* summed per unit, the 32-bit cycle counter wraps within seconds */
+        uint32_t start = cycles::now();
+        while ((size > 0) && (res == 0))
+        {
+            const bool whole_sector = ((dst % sect) == 0) && (size >= sect);
+            const uint32_t n = whole_sector ? sect : ((size < unit) ? size : unit);
+            res = whole_sector ? copy_sector(dst, src) : copy_unit(dst, src, n);
+            dst += n;
+            src += n;
+            size -= n;
+            _stats.bytes += n;
+            const uint32_t now = cycles::now();
+            _stats.cycles += now - start;
+            start = now;
+        }
+        if (res == 0)
+        {
+            res = settle();
+        }
+        _stats.cycles += cycles::now() - start;
+        return res;
+    }
+
+    const stats_t &stats() const { return _stats; }
+
+private:
+    static constexpr uint32_t unit = flash_t::get_subsect_size();
+    static constexpr uint32_t sect = flash_t::get_sect_size();
+    static constexpr uint32_t pg = flash_t::get_pg();
+    /* units to erase from which a sector erase is cheaper */
+    static constexpr uint32_t sector_erase_min = sect / unit / 4;
+
+    enum diff_t
+    {
+        SAME,    // destination holds the data
+        PROGRAM, // only bits to clear
+        ERASE    // the unit has to be erased first
+    };
+
+
+    int copy_unit(uint32_t dst, uint32_t src, uint32_t n)
+    {
+        auto res = load(dst, src, n);
+        if (res != 0)
+        {
+            return res;
+        }
+        const auto diff = compare();
+        if (diff == SAME)
+        {
+            _stats.units_skipped++;
+            _stats.pages_skipped += unit / pg;
+            return 0;
+        }
+        if (diff == ERASE)
+        {
+            res = _flash.erase_subsector(reinterpret_cast<void *>(dst), false);
+            if (res != 0)
+            {
+                return res;
+            }
+            _in_flight = true;
+            _stats.erases++;
+            _dst.fill(0xFF);
+        }
+        return program_unit(dst);
+    }
+
+    /**
+     * @brief a destination sector the copy covers completely
+     *
+     * Few units to erase: unit by unit as above. Otherwise one sector erase
+     * and the source units are programmed onto it.
+     */
+    int copy_sector(uint32_t dst, uint32_t src)
+    {
+        uint32_t dirty = 0;
+        for (uint32_t off = 0; off < sect; off += unit)
+        {
+            auto res = load(dst + off, src + off, unit);
+            if (res != 0)
+            {
+                return res;
+            }
+            dirty += (compare() == ERASE) ? 1 : 0;
+        }
+        if (dirty < sector_erase_min)
+        {
+            for (uint32_t off = 0; off < sect; off += unit)
+            {
+                auto res = copy_unit(dst + off, src + off, unit);
+                if (res != 0)
+                {
+                    return res;
+                }
+            }
+            return 0;
+        }
+        auto res = _flash.erase_sector(reinterpret_cast<void *>(dst), false);
+        if (res != 0)
+        {
+            return res;
+        }
+        _in_flight = true;
+        _stats.sector_erases++;
+        for (uint32_t off = 0; off < sect; off += unit)
+        {
+            res = settle();
+            if (res == 0)
+            {
+                res = _flash.read(reinterpret_cast<void *>(src + off), unit, _src.data());
+            }
+            if (res != 0)
+            {
+                return res;
+            }
+            _dst.fill(0xFF);
+            res = program_unit(dst + off);
+            if (res != 0)
+            {
+                return res;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * @brief read a source and a destination unit into the buffers
+     */
+    int load(uint32_t dst, uint32_t src, uint32_t n)
+    {
+        auto res = settle();
+        if (res == 0)
+        {
+            res = _flash.read(reinterpret_cast<void *>(src), n, _src.data());
+        }
+        if (res == 0)
+        {
+            res = _flash.read(reinterpret_cast<void *>(dst), unit, _dst.data());
+        }
+        if (res != 0)
+        {
+            return res;
+        }
+        /* a partial last unit keeps the destination bytes behind the copy */
+        memcpy(&_src[n], &_dst[n], unit - n);
+        return 0;
+    }
+
+    diff_t compare() const
+    {
+        bool changed = false;
+        for (uint32_t i = 0; i < unit; i++)
+        {
+            if (_src[i] != _dst[i])
+            {
+                changed = true;
+                if ((_src[i] & _dst[i]) != _src[i])
+                {
+                    return ERASE;
+                }
+            }
+        }
+        return changed ? PROGRAM : SAME;
+    }
+
+    /**
+     * @brief program the pages of _src that differ from _dst (the destination content)
+     */
+    int program_unit(uint32_t dst)
+    {
+        for (uint32_t p = 0; p < unit; p += pg)
+        {
+            /* decided while the previous erase/program runs */
+            if (memcmp(&_src[p], &_dst[p], pg) == 0)
+            {
+                _stats.pages_skipped++;
+                continue;
+            }
+            auto res = settle();
+            if (res == 0)
+            {
+                res = _flash.program_page(reinterpret_cast<void *>(dst + p), pg, &_src[p], false);
+            }
+            if (res != 0)
+            {
+                return res;
+            }
+            _in_flight = true;
+            _stats.pages++;
+        }
+        return 0;
+    }
+
+    int settle()
+    {
+        if (!_in_flight)
+        {
+            return 0;
+        }
+        _in_flight = false;
+        return _flash.wait_ready();
+    }
+
+    flash_t &_flash;
+    bool _in_flight = false;
+    stats_t _stats = {};
+    std::array<uint8_t, unit> _src;
+    std::array<uint8_t, unit> _dst;
+};
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef DELTA_PATCH_HPP
+#define DELTA_PATCH_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include "stm32h7xx.h"
+#include "QspiFlash.hpp"
+
+/**
+ * @brief Rebuilds a new image from an old image and a patch made by Tools/deltagen.py
+ *
+ * Patch layout, all fields little endian, lengths and offsets are LEB128:
+ *
+ *   header : magic "DLTQ", old size, new size, CRC-32 of the new image,
+ *            ~(magic ^ old size ^ new size ^ crc)
+ *   ops    : 0x00 COPY old offset, length   (bytes of the old image)
+ *            0x01 INSERT length, bytes      (literal bytes)
+ *
+ * Old image and patch are read through the memory mapped window, the new
+ * image is assembled one page at a time in RAM and programmed in order into
+ * the target slot, which is erased ahead in 4KB units (blank units are left
+ * alone). Only blank pages are skipped. The CRC of the produced image is
+ * checked at the end.
+ *
+ * The target slot must be 4KB aligned and must not overlap the old image or
+ * the patch. The flash is expected in indirect mode and is left in indirect
+ * mode.
+ */
+template <QspiFlash flash_t>
+class delta_patch
+{
+public:
+    static constexpr uint32_t magic = 0x51544C44; // "DLTQ"
+    static constexpr uint32_t header_size = 20;
+
+    delta_patch(flash_t &flash) : _flash(flash) {}
+
+    /**
+     * @brief apply a patch
+     *
+     * @param old_off flash offset of the old image
+     * @param patch_off flash offset of the patch
+     * @param patch_size size of the patch
+     * @param new_off flash offset of the target slot, 4KB aligned
+     * @return int 0 if the new image was programmed and matches its CRC, error otherwise
+     */
+    int apply(uint32_t old_off, uint32_t patch_off, uint32_t patch_size, uint32_t new_off)
+    {
+        if (((new_off % unit) != 0) || (patch_size < header_size))
+        {
+            return 1;
+        }
+        _programs = 0;
+        auto res = _flash.ensure_mapped();
+        if (res != 0)
+        {
+            return res;
+        }
+        const uint8_t *patch = window(patch_off);
+        const uint8_t *old = window(old_off);
+        SCB_InvalidateDCache_by_Addr(const_cast<uint8_t *>(patch), patch_size);
+        const uint32_t mg = get_le32(patch);
+        const uint32_t old_size = get_le32(patch + 4);
+        const uint32_t new_size = get_le32(patch + 8);
+        const uint32_t crc = get_le32(patch + 12);
+        if ((mg != magic) || (get_le32(patch + 16) != ~(mg ^ old_size ^ new_size ^ crc)) ||
+            overlaps(new_off, new_size, old_off, old_size) || overlaps(new_off, new_size, patch_off, patch_size))
+        {
+            _flash.ensure_indirect();
+            return 1;
+        }
+        SCB_InvalidateDCache_by_Addr(const_cast<uint8_t *>(old), old_size);
+
+        _dest = new_off;
+        _end = new_off + new_size;
+        _fill = 0;
+        _crc = 0xFFFFFFFF;
+        uint32_t pos = header_size;
+        res = 0;
+        while ((pos < patch_size) && (res == 0))
+        {
+            const uint8_t op = patch[pos++];
+            uint32_t a = 0;
+            uint32_t len = 0;
+            if ((get_varint(patch, patch_size, pos, a) != 0) ||
+                ((op == COPY) && (get_varint(patch, patch_size, pos, len) != 0)))
+            {
+                res = 1;
+                break;
+            }
+            if (op == COPY)
+            {
+                res = ((a <= old_size) && (len <= old_size - a)) ? emit(old + a, len) : 1;
+            }
+            else if ((op == INSERT) && (a <= patch_size - pos))
+            {
+                res = emit(patch + pos, a);
+                pos += a;
+            }
+            else
+            {
+                res = 1;
+            }
+        }
+        if ((res == 0) && (_fill > 0))
+        {
+            res = program();
+        }
+        if ((res == 0) && ((_dest != _end) || (~_crc != crc)))
+        {
+            res = 1;
+        }
+        const auto ures = _flash.ensure_indirect();
+        return (res != 0) ? res : ures;
+    }
+
+    /**
+     * @brief page programs issued by the last apply()
+     */
+    uint32_t programs() const { return _programs; }
+
+private:
+    enum op_t : uint8_t
+    {
+        COPY = 0x00,
+        INSERT = 0x01,
+    };
+
+    static constexpr uint32_t unit = flash_t::get_subsect_size();
+    static constexpr uint32_t pg = flash_t::get_pg();
+
+    static uint32_t get_le32(const uint8_t *buf)
+    {
+        return static_cast<uint32_t>(buf[0]) | (static_cast<uint32_t>(buf[1]) << 8) |
+               (static_cast<uint32_t>(buf[2]) << 16) | (static_cast<uint32_t>(buf[3]) << 24);
+    }
+
+    static int get_varint(const uint8_t *buf, uint32_t size, uint32_t &pos, uint32_t &val)
+    {
+        val = 0;
+        for (uint32_t shift = 0; (shift < 32) && (pos < size); shift += 7)
+        {
+            const uint8_t b = buf[pos++];
+            val |= static_cast<uint32_t>(b & 0x7F) << shift;
+            if ((b & 0x80) == 0)
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    static bool overlaps(uint32_t a, uint32_t a_size, uint32_t b, uint32_t b_size)
+    {
+        return (a < b + b_size) && (b < a + a_size);
+    }
+
+    static const uint8_t *window(uint32_t off) { return reinterpret_cast<const uint8_t *>(QSPI_BASE + off); }
+
+    /**
+     * @brief append output bytes, programming every completed page
+     */
+    int emit(const uint8_t *src, uint32_t len)
+    {
+        if (len > _end - _dest - _fill)
+        {
+            return 1;
+        }
+        while (len > 0)
+        {
+            uint32_t take = pg - _fill;
+            if (take > len)
+            {
+                take = len;
+            }
+            memcpy(&_page[_fill], src, take);
+            _fill += take;
+            src += take;
+            len -= take;
+            if (_fill == pg)
+            {
+                auto res = program();
+                if (res != 0)
+                {
+                    return res;
+                }
+            }
+        }
+        return 0;
+    }
+
+    int program()
+    {
+        for (uint32_t i = 0; i < _fill; i++)
+        {
+            _crc ^= _page[i];
+            for (uint32_t b = 0; b < 8; b++)
+            {
+                _crc = (_crc >> 1) ^ (0xEDB88320UL & (0UL - (_crc & 1)));
+            }
+        }
+        bool blank = true;
+        for (uint32_t i = 0; i < _fill; i++)
+        {
+            blank = blank && (_page[i] == 0xFF);
+        }
+        /* the target unit is checked (mapped) before its first page */
+        bool erase = false;
+        if ((_dest % unit) == 0)
+        {
+            const uint8_t *win = window(_dest);
+            for (uint32_t i = 0; (i < unit) && !erase; i++)
+            {
+                erase = (win[i] != 0xFF);
+            }
+        }
+        if (erase || !blank)
+        {
+            auto res = _flash.ensure_indirect();
+            if ((res == 0) && erase)
+            {
+                res = _flash.erase(reinterpret_cast<void *>(_dest), unit);
+            }
+            if ((res == 0) && !blank)
+            {
+                res = _flash.program_page(reinterpret_cast<void *>(_dest), _fill, _page.data());
+                _programs++;
+            }
+            if (res == 0)
+            {
+                res = _flash.ensure_mapped();
+            }
+            if (res != 0)
+            {
+                return res;
+            }
+        }
+        _dest += _fill;
+        _fill = 0;
+        return 0;
+    }
+
+    flash_t &_flash;
+    uint32_t _dest = 0;     // flash offset of _page
+    uint32_t _end = 0;      // end of the new image
+    uint32_t _fill = 0;     // bytes in _page
+    uint32_t _crc = 0;      // running CRC-32 of the new image
+    uint32_t _programs = 0;
+    std::array<uint8_t, pg> _page;
+};
+
+#endif
@@ -0,0 +1,723 @@
+#ifndef KV_STORE_HPP
+#define KV_STORE_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include "stm32h7xx.h"
+#include "QspiFlash.hpp"
+
+/**
+ * @brief Log structured key-value store with wear leveling
+ *
+ * The region is split in erase units (blocks, 4KB). Every block starts with a
+ * header, records are appended behind it:
+ *
+ *   block  : magic "KVS1", erase count, ~(magic ^ erase count), sequence
+ *            (0xFFFFFFFF while the block is free)
+ *   record : key, length (16 bits), flags (0xFF value, 0x00 deleted),
+ *            commit byte, data, padding to 4 bytes
+ *
+ * A record is programmed with the commit byte left at 0xFF, the commit byte
+ * is programmed to 0x00 afterwards. A record without commit byte marks the
+ * end of a block (power lost while writing), the block is not appended to
+ * anymore. Newer blocks (higher sequence) win over older ones.
+ *
+ * mount() scans the region through the memory mapped window and rebuilds the
+ * RAM index (open addressing hash of key -> record). Garbage collection picks
+ * the block with the most dead bytes, copies its live records to the head of
+ * the log and erases it. One free block is always kept in reserve for it.
+ * Free blocks are allocated lowest erase count first. When the erase counts
+ * drift apart by more than wear_delta the least worn used block is collected
+ * instead, so cold data moves onto worn blocks. An erased block gets its
+ * header with the incremented erase count at once; a block found without
+ * header (power lost in between) takes the highest count of the region.
+ *
+ * The flash is expected in indirect mode and is left in indirect mode.
+ */
+template <QspiFlash flash_t, uint32_t max_keys = 1024, uint32_t max_blocks = 64>
+class kv_store
+{
+    static_assert((max_keys & (max_keys - 1)) == 0, "index size must be a power of 2");
+
+public:
+    static constexpr uint32_t block = flash_t::get_subsect_size();
+    static constexpr uint32_t block_header = 16;
+    static constexpr uint32_t rec_header = 8;
+    static constexpr uint32_t max_value = block - block_header - rec_header;
+    static constexpr uint32_t wear_delta = 16;
+
+    struct stats_t
+    {
+        uint32_t gc_runs;     // blocks collected
+        uint32_t gc_copied;   // records moved by the garbage collection
+        uint32_t wear_moves;  // collections forced by wear leveling
+        uint32_t min_erase;   // lowest block erase count
+        uint32_t max_erase;   // highest block erase count
+    };
+
+    /**
+     * @param flash flash driver
+     * @param start flash offset of the region, 4KB aligned
+     * @param blocks number of 4KB blocks, at least 3
+     */
+    kv_store(flash_t &flash, uint32_t start, uint32_t blocks)
+        : _flash(flash), _start(start), _blocks((blocks < max_blocks) ? blocks : max_blocks)
+    {
+    }
+
+    /**
+     * @brief erase the whole region, the store is empty and mounted afterwards
+     *
+     * The erase counts of the blocks are kept.
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int format()
+    {
+        auto res = _flash.ensure_mapped();
+        if (res != 0)
+        {
+            return res;
+        }
+        scan_headers();
+        res = _flash.ensure_indirect();
+        for (uint32_t b = 0; (b < _blocks) && (res == 0); b++)
+        {
+            res = recycle(b);
+        }
+        return (res != 0) ? res : mount();
+    }
+
+    /**
+     * @brief rebuild the index from the flash content
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int mount()
+    {
+        clear_index();
+        _stats = {};
+        _active = none;
+        _next_seq = 0;
+        auto res = _flash.ensure_mapped();
+        if (res != 0)
+        {
+            return res;
+        }
+        scan_headers();
+        /* replay the used blocks oldest first, newer records override */
+        res = 0;
+        for (uint32_t b = next_used(none); (b != none) && (res == 0); b = next_used(b))
+        {
+            res = replay(b);
+            _active = b;
+        }
+        const auto ares = _flash.ensure_indirect();
+        if (res != 0)
+        {
+            return res;
+        }
+        if (ares != 0)
+        {
+            return ares;
+        }
+        for (uint32_t b = 0; b < _blocks; b++)
+        {
+            if ((_seq[b] == free_seq) && (_used[b] == block))
+            {
+                res = recycle(b);
+                if (res != 0)
+                {
+                    return res;
+                }
+            }
+        }
+        update_wear();
+        return 0;
+    }
+
+    /**
+     * @brief store a value, replacing the previous one
+     *
+     * @return int 0 if successful, error otherwise (store full, index full)
+     */
+    int put(uint32_t key, const void *data, uint32_t len)
+    {
+        if ((key == empty_key) || (len > max_value))
+        {
+            return 1;
+        }
+        if ((find(key) == nullptr) && (_count >= max_keys - max_keys / 4))
+        {
+            return 1;
+        }
+        return append(key, static_cast<const uint8_t *>(data), len, value_flag, false);
+    }
+
+    /**
+     * @brief read a value
+     *
+     * @param key key
+     * @param buf destination, the value is truncated to size
+     * @param size size of buf
+     * @param len set to the length of the value
+     * @return int 0 if found, 1 if the key does not exist, error otherwise
+     */
+    int get(uint32_t key, void *buf, uint32_t size, uint32_t &len)
+    {
+        const slot_t *s = find(key);
+        if ((s == nullptr) || (s->flags != value_flag))
+        {
+            return 1;
+        }
+        len = s->len;
+        return _flash.read(reinterpret_cast<void *>(s->addr + rec_header), (len < size) ? len : size, buf);
+    }
+
+    /**
+     * @brief delete a key
+     *
+     * @return int 0 if successful or not present, error otherwise
+     */
+    int remove(uint32_t key)
+    {
+        const slot_t *s = find(key);
+        if ((s == nullptr) || (s->flags != value_flag))
+        {
+            return 0;
+        }
+        return append(key, nullptr, 0, deleted_flag, false);
+    }
+
+    /**
+     * @brief number of keys in the index, deleted keys not collected yet included
+     */
+    uint32_t count() const { return _count; }
+
+    const stats_t &stats() const { return _stats; }
+
+private:
+    static constexpr uint32_t magic = 0x3153564B; // "KVS1"
+    static constexpr uint32_t free_seq = 0xFFFFFFFF;
+    static constexpr uint32_t empty_key = 0xFFFFFFFF;
+    static constexpr uint32_t none = 0xFFFFFFFF;
+    static constexpr uint8_t value_flag = 0xFF;
+    static constexpr uint8_t deleted_flag = 0x00;
+    static constexpr uint8_t committed = 0x00;
+
+    struct slot_t
+    {
+        uint32_t key;  // empty_key when unused
+        uint32_t addr; // flash offset of the record
+        uint16_t len;  // value length
+        uint8_t flags; // value_flag or deleted_flag
+    };
+
+    static uint32_t get_le32(const uint8_t *buf)
+    {
+        return static_cast<uint32_t>(buf[0]) | (static_cast<uint32_t>(buf[1]) << 8) |
+               (static_cast<uint32_t>(buf[2]) << 16) | (static_cast<uint32_t>(buf[3]) << 24);
+    }
+
+    static void put_le32(uint8_t *buf, uint32_t val)
+    {
+        buf[0] = static_cast<uint8_t>(val);
+        buf[1] = static_cast<uint8_t>(val >> 8);
+        buf[2] = static_cast<uint8_t>(val >> 16);
+        buf[3] = static_cast<uint8_t>(val >> 24);
+    }
+
+    static uint32_t rec_size(uint32_t len) { return (rec_header + len + 3) & ~3UL; }
+
+    static const uint8_t *window(uint32_t off) { return reinterpret_cast<const uint8_t *>(QSPI_BASE + off); }
+
+    static bool is_blank(const uint8_t *buf, uint32_t size)
+    {
+        for (uint32_t i = 0; i < size; i++)
+        {
+            if (buf[i] != 0xFF)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint32_t base(uint32_t b) const { return _start + b * block; }
+    uint32_t block_of(uint32_t addr) const { return (addr - _start) / block; }
+
+    /**
+     * @brief used block following prev in sequence order, none after the newest
+     */
+    uint32_t next_used(uint32_t prev) const
+    {
+        uint32_t next = none;
+        for (uint32_t b = 0; b < _blocks; b++)
+        {
+            if ((_seq[b] != free_seq) && ((prev == none) || (_seq[b] > _seq[prev])) &&
+                ((next == none) || (_seq[b] < _seq[next])))
+            {
+                next = b;
+            }
+        }
+        return next;
+    }
+
+    /**
+     * @brief read the block headers (mapped mode)
+     *
+     * A block without header lost its erase count: power failed between the
+     * erase and the header, or during the erase. It takes the highest count
+     * found, so wear leveling does not take it for the least worn block.
+     */
+    void scan_headers()
+    {
+        SCB_InvalidateDCache_by_Addr(reinterpret_cast<void *>(QSPI_BASE + _start), _blocks * block);
+        std::array<bool, max_blocks> lost;
+        uint32_t highest = 0;
+        for (uint32_t b = 0; b < _blocks; b++)
+        {
+            const uint8_t *win = window(base(b));
+            const uint32_t mg = get_le32(win);
+            _seq[b] = free_seq;
+            _used[b] = block_header;
+            _live[b] = 0;
+            lost[b] = (mg != magic) || (get_le32(win + 8) != ~(mg ^ get_le32(win + 4)));
+            if (!lost[b])
+            {
+                _erase[b] = get_le32(win + 4);
+                _seq[b] = get_le32(win + 12);
+                highest = (_erase[b] > highest) ? _erase[b] : highest;
+                if ((_seq[b] != free_seq) && (_seq[b] + 1 > _next_seq))
+                {
+                    _next_seq = _seq[b] + 1;
+                }
+            }
+            else if (!is_blank(win, block))
+            {
+                /* interrupted erase or foreign data, erased by mount() */
+                _used[b] = block;
+            }
+        }
+        for (uint32_t b = 0; b < _blocks; b++)
+        {
+            _erase[b] = lost[b] ? highest : _erase[b];
+        }
+    }
+
+    uint32_t free_blocks() const
+    {
+        uint32_t n = 0;
+        for (uint32_t b = 0; b < _blocks; b++)
+        {
+            n += ((_seq[b] == free_seq) && (_used[b] == block_header)) ? 1 : 0;
+        }
+        return n;
+    }
+
+    /**
+     * @brief index the committed records of a block (mapped mode)
+     */
+    int replay(uint32_t b)
+    {
+        const uint8_t *win = window(base(b));
+        uint32_t off = block_header;
+        while (off + rec_header <= block)
+        {
+            const uint8_t *rec = win + off;
+            const uint32_t key = get_le32(rec);
+            const uint32_t len = rec[4] | (static_cast<uint32_t>(rec[5]) << 8);
+            if ((key == empty_key) && (len == 0xFFFF))
+            {
+                break;
+            }
+            if ((rec[7] != committed) || (off + rec_size(len) > block))
+            {
+                /* power lost while writing: never append here again */
+                off = block;
+                break;
+            }
+            if (index_set(key, base(b) + off, len, rec[6]) != 0)
+            {
+                return 1;
+            }
+            off += rec_size(len);
+        }
+        _used[b] = off;
+        return 0;
+    }
+
+    /**
+     * @brief append a record at the head of the log and index it
+     */
+    int append(uint32_t key, const uint8_t *data, uint32_t len, uint8_t flags, bool gc)
+    {
+        const uint32_t need = rec_size(len);
+        if ((_active == none) || (_used[_active] + need > block))
+        {
+            /* the last free block is kept for the garbage collection */
+            while (!gc && (free_blocks() < 2))
+            {
+                auto res = collect();
+                if (res != 0)
+                {
+                    return res;
+                }
+                if ((_active != none) && (_used[_active] + need <= block))
+                {
+                    break;
+                }
+            }
+            if ((_active == none) || (_used[_active] + need > block))
+            {
+                auto res = allocate();
+                if (res != 0)
+                {
+                    return res;
+                }
+            }
+        }
+        const uint32_t addr = base(_active) + _used[_active];
+        std::array<uint8_t, rec_header> hdr;
+        put_le32(hdr.data(), key);
+        hdr[4] = static_cast<uint8_t>(len);
+        hdr[5] = static_cast<uint8_t>(len >> 8);
+        hdr[6] = flags;
+        hdr[7] = 0xFF; // commit byte, programmed last
+        const qspi_driver::segment_t segs[2] = {{hdr.data(), rec_header}, {data, len}};
+        _used[_active] += need;
+        auto res = program(addr, segs, (len > 0) ? 2 : 1);
+        if (res == 0)
+        {
+            const uint8_t commit = committed;
+            res = _flash.program_page(reinterpret_cast<void *>(addr + 7), 1, const_cast<uint8_t *>(&commit));
+        }
+        if (res != 0)
+        {
+            /* unknown content, leave the block */
+            _used[_active] = block;
+            return res;
+        }
+        return index_set(key, addr, len, flags);
+    }
+
+    /**
+     * @brief program segments as one stream, split at page boundaries
+     */
+    int program(uint32_t addr, const qspi_driver::segment_t *segs, uint32_t count)
+    {
+        constexpr uint32_t pg = flash_t::get_pg();
+        uint32_t s = 0;
+        uint32_t used = 0; // bytes of segs[s] already programmed
+        while (s < count)
+        {
+            qspi_driver::segment_t page[2];
+            uint32_t n = 0;
+            uint32_t room = pg - (addr % pg);
+            const uint32_t start = addr;
+            while ((s < count) && (room > 0) && (n < 2))
+            {
+                uint32_t take = segs[s].size - used;
+                take = (take < room) ? take : room;
+                page[n++] = {segs[s].buf + used, take};
+                used += take;
+                room -= take;
+                addr += take;
+                if (used == segs[s].size)
+                {
+                    s++;
+                    used = 0;
+                }
+            }
+            auto res = _flash.program_page(reinterpret_cast<void *>(start), page, n);
+            if (res != 0)
+            {
+                return res;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * @brief turn a free block into the head of the log
+     */
+    int allocate()
+    {
+        uint32_t pick = none;
+        for (uint32_t b = 0; b < _blocks; b++)
+        {
+            if ((_seq[b] == free_seq) && (_used[b] == block_header) && ((pick == none) || (_erase[b] < _erase[pick])))
+            {
+                pick = b;
+            }
+        }
+        if (pick == none)
+        {
+            return 1;
+        }
+        std::array<uint8_t, block_header> hdr;
+        put_le32(&hdr[0], magic);
+        put_le32(&hdr[4], _erase[pick]);
+        put_le32(&hdr[8], ~(magic ^ _erase[pick]));
+        put_le32(&hdr[12], _next_seq);
+        auto res = _flash.program_page(reinterpret_cast<void *>(base(pick)), block_header, hdr.data());
+        if (res != 0)
+        {
+            _used[pick] = block;
+            return res;
+        }
+        _seq[pick] = _next_seq++;
+        _active = pick;
+        return 0;
+    }
+
+    /**
+     * @brief erase a block and mark it free, its erase count incremented
+     *
+     * The count is programmed right after the erase, before the block takes
+     * any data.
+     */
+    int recycle(uint32_t b)
+    {
+        auto res = _flash.erase(reinterpret_cast<void *>(base(b)), block);
+        if (res != 0)
+        {
+            return res;
+        }
+        _erase[b]++;
+        std::array<uint8_t, 12> hdr;
+        put_le32(&hdr[0], magic);
+        put_le32(&hdr[4], _erase[b]);
+        put_le32(&hdr[8], ~(magic ^ _erase[b]));
+        res = _flash.program_page(reinterpret_cast<void *>(base(b)), hdr.size(), hdr.data());
+        if (res != 0)
+        {
+            return res;
+        }
+        _seq[b] = free_seq;
+        _used[b] = block_header;
+        _live[b] = 0;
+        if (_active == b)
+        {
+            _active = none;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief collect one block: copy its live records to the log head, erase it
+     */
+    int collect()
+    {
+        const uint32_t victim = pick_victim();
+        if (victim == none)
+        {
+            return 1;
+        }
+        uint32_t oldest = victim;
+        for (uint32_t b = 0; b < _blocks; b++)
+        {
+            if ((_seq[b] != free_seq) && (_seq[b] < _seq[oldest]))
+            {
+                oldest = b;
+            }
+        }
+        if (victim == _active)
+        {
+            _active = none;
+        }
+        for (uint32_t off = block_header; off + rec_header <= _used[victim];)
+        {
+            std::array<uint8_t, rec_header> hdr;
+            auto res = _flash.read(reinterpret_cast<void *>(base(victim) + off), rec_header, hdr.data());
+            if (res != 0)
+            {
+                return res;
+            }
+            const uint32_t key = get_le32(hdr.data());
+            const uint32_t len = hdr[4] | (static_cast<uint32_t>(hdr[5]) << 8);
+            if ((hdr[7] != committed) || (len > max_value))
+            {
+                break;
+            }
+            const slot_t *s = find(key);
+            if ((s != nullptr) && (s->addr == base(victim) + off))
+            {
+                if ((hdr[6] == deleted_flag) && (victim == oldest))
+                {
+                    /* nothing older left for the tombstone to hide */
+                    erase_slot(key);
+                }
+                else
+                {
+                    res = _flash.read(reinterpret_cast<void *>(base(victim) + off + rec_header), len, _tmp.data());
+                    if (res == 0)
+                    {
+                        res = append(key, _tmp.data(), len, hdr[6], true);
+                    }
+                    if (res != 0)
+                    {
+                        return res;
+                    }
+                    _stats.gc_copied++;
+                }
+            }
+            off += rec_size(len);
+        }
+        auto res = recycle(victim);
+        if (res != 0)
+        {
+            return res;
+        }
+        _stats.gc_runs++;
+        update_wear();
+        return 0;
+    }
+
+    uint32_t pick_victim()
+    {
+        uint32_t coldest = none;
+        uint32_t dirtiest = none;
+        uint32_t dirt = 0;
+        for (uint32_t b = 0; b < _blocks; b++)
+        {
+            if ((_seq[b] == free_seq) || (b == _active))
+            {
+                continue;
+            }
+            if ((coldest == none) || (_erase[b] < _erase[coldest]))
+            {
+                coldest = b;
+            }
+            const uint32_t dead = _used[b] - block_header - _live[b];
+            if (dead > dirt)
+            {
+                dirt = dead;
+                dirtiest = b;
+            }
+        }
+        if ((coldest != none) && (_stats.max_erase - _erase[coldest] > wear_delta))
+        {
+            _stats.wear_moves++;
+            return coldest;
+        }
+        if ((dirtiest == none) && (_active != none) && (_used[_active] > block_header + _live[_active]))
+        {
+            /* only the head of the log has dead records */
+            dirtiest = _active;
+        }
+        return dirtiest;
+    }
+
+    void update_wear()
+    {
+        _stats.min_erase = 0xFFFFFFFF;
+        _stats.max_erase = 0;
+        for (uint32_t b = 0; b < _blocks; b++)
+        {
+            _stats.min_erase = (_erase[b] < _stats.min_erase) ? _erase[b] : _stats.min_erase;
+            _stats.max_erase = (_erase[b] > _stats.max_erase) ? _erase[b] : _stats.max_erase;
+        }
+    }
+
+    /* ---- RAM index, linear probing with backward shift deletion ---- */
+
+    static uint32_t hash(uint32_t key) { return (key * 0x9E3779B1UL) & (max_keys - 1); }
+
+    void clear_index()
+    {
+        for (auto &s : _index)
+        {
+            s.key = empty_key;
+        }
+        _count = 0;
+    }
+
+    slot_t *find(uint32_t key)
+    {
+        for (uint32_t i = hash(key), n = 0; n < max_keys; i = (i + 1) & (max_keys - 1), n++)
+        {
+            if (_index[i].key == key)
+            {
+                return &_index[i];
+            }
+            if (_index[i].key == empty_key)
+            {
+                return nullptr;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief point a key to a new record, the old record becomes dead
+     */
+    int index_set(uint32_t key, uint32_t addr, uint32_t len, uint8_t flags)
+    {
+        slot_t *s = find(key);
+        if (s != nullptr)
+        {
+            _live[block_of(s->addr)] -= rec_size(s->len);
+        }
+        else
+        {
+            if (_count >= max_keys - 1)
+            {
+                return 1;
+            }
+            uint32_t i = hash(key);
+            while (_index[i].key != empty_key)
+            {
+                i = (i + 1) & (max_keys - 1);
+            }
+            s = &_index[i];
+            s->key = key;
+            _count++;
+        }
+        s->addr = addr;
+        s->len = static_cast<uint16_t>(len);
+        s->flags = flags;
+        _live[block_of(addr)] += rec_size(len);
+        return 0;
+    }
+
+    void erase_slot(uint32_t key)
+    {
+        slot_t *s = find(key);
+        if (s == nullptr)
+        {
+            return;
+        }
+        _live[block_of(s->addr)] -= rec_size(s->len);
+        uint32_t hole = static_cast<uint32_t>(s - _index.data());
+        for (uint32_t i = (hole + 1) & (max_keys - 1); _index[i].key != empty_key; i = (i + 1) & (max_keys - 1))
+        {
+            /* move back entries whose home slot is not between the hole and them */
+            const uint32_t home = hash(_index[i].key);
+            if (((i - home) & (max_keys - 1)) >= ((i - hole) & (max_keys - 1)))
+            {
+                _index[hole] = _index[i];
+                hole = i;
+            }
+        }
+        _index[hole].key = empty_key;
+        _count--;
+    }
+
+    flash_t &_flash;
+    const uint32_t _start;
+    const uint32_t _blocks;
+    uint32_t _active = none; // block appended to
+    uint32_t _next_seq = 0;
+    uint32_t _count = 0;
+    stats_t _stats = {};
+    std::array<uint32_t, max_blocks> _erase; // erase count
+    std::array<uint32_t, max_blocks> _seq;   // sequence, free_seq when free
+    std::array<uint32_t, max_blocks> _used;  // append offset in the block
+    std::array<uint32_t, max_blocks> _live;  // bytes of indexed records
+    std::array<slot_t, max_keys> _index;
+    std::array<uint8_t, max_value> _tmp;     // record copied by the garbage collection
+};
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef LFS_FLASH_HPP
+#define LFS_FLASH_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include "stm32h7xx.h"
+#include "lfs.h"
+#include "QspiFlash.hpp"
+
+/**
+ * @brief littlefs block device on a flash region
+ *
+ * Reads are copied straight from the memory mapped window, program and erase
+ * go through the driver. The driver is switched between the two modes on
+ * demand (ensure_mapped()/ensure_indirect()), the driver drops the
+ * cache lines of what it programs or erases. Blocks are the 4KB erase units,
+ * the program size is one page.
+ *
+ * The flash is expected in indirect mode, call release() before using it
+ * directly again.
+ */
+template <QspiFlash flash_t, uint32_t cache_size = flash_t::get_pg(), uint32_t lookahead_size = 16>
+class lfs_flash
+{
+public:
+    static constexpr uint32_t block_size = flash_t::get_subsect_size();
+    static constexpr uint32_t prog_size = flash_t::get_pg();
+    static_assert((cache_size % prog_size) == 0, "cache must hold whole pages");
+    static_assert((block_size % cache_size) == 0, "cache must divide the block");
+
+    /**
+     * @param flash flash driver
+     * @param start flash offset of the file system, 4KB aligned
+     * @param size size of the file system, multiple of 4KB
+     * @param block_cycles erase cycles before littlefs moves a metadata block
+     */
+    lfs_flash(flash_t &flash, uint32_t start, uint32_t size, int32_t block_cycles = 500)
+        : _flash(flash), _start(start)
+    {
+        memset(&_cfg, 0, sizeof(_cfg));
+        _cfg.context = this;
+        _cfg.read = read;
+        _cfg.prog = prog;
+        _cfg.erase = erase;
+        _cfg.sync = sync;
+        _cfg.read_size = 16;
+        _cfg.prog_size = prog_size;
+        _cfg.block_size = block_size;
+        _cfg.block_count = size / block_size;
+        _cfg.block_cycles = block_cycles;
+        _cfg.cache_size = cache_size;
+        _cfg.lookahead_size = lookahead_size;
+        _cfg.read_buffer = _read_buf;
+        _cfg.prog_buffer = _prog_buf;
+        _cfg.lookahead_buffer = _lookahead_buf;
+    }
+
+    /**
+     * @brief configuration for lfs_mount()/lfs_format()
+     */
+    const struct lfs_config *config() const { return &_cfg; }
+
+    /**
+     * @brief leave the flash in indirect mode
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int release() { return _flash.ensure_indirect(); }
+
+private:
+    static lfs_flash &self(const struct lfs_config *c) { return *static_cast<lfs_flash *>(c->context); }
+
+    static int read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+    {
+        auto &dev = self(c);
+        if (dev._flash.ensure_mapped() != 0)
+        {
+            return LFS_ERR_IO;
+        }
+        memcpy(buffer, reinterpret_cast<const void *>(QSPI_BASE + dev.offset(block, off)), size);
+        return 0;
+    }
+
+    static int prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer,
+                    lfs_size_t size)
+    {
+        auto &dev = self(c);
+        const uint32_t adr = dev.offset(block, off);
+        if ((dev._flash.ensure_indirect() != 0) ||
+            (dev._flash.program(reinterpret_cast<void *>(adr), size, const_cast<void *>(buffer)) != 0))
+        {
+            return LFS_ERR_IO;
+        }
+        return 0;
+    }
+
+    static int erase(const struct lfs_config *c, lfs_block_t block)
+    {
+        auto &dev = self(c);
+        const uint32_t adr = dev.offset(block, 0);
+        if ((dev._flash.ensure_indirect() != 0) ||
+            (dev._flash.erase(reinterpret_cast<void *>(adr), block_size) != 0))
+        {
+            return LFS_ERR_IO;
+        }
+        return 0;
+    }
+
+    /* program and erase complete before returning */
+    static int sync(const struct lfs_config *c) { return 0; }
+
+    uint32_t offset(lfs_block_t block, lfs_off_t off) const { return _start + block * block_size + off; }
+
+    flash_t &_flash;
+    const uint32_t _start;
+    struct lfs_config _cfg;
+    alignas(4) uint8_t _read_buf[cache_size];
+    alignas(4) uint8_t _prog_buf[cache_size];
+    alignas(4) uint8_t _lookahead_buf[lookahead_size];
+};
+
+#endif
@@ -0,0 +1,433 @@
+#ifndef LZ4_STREAM_HPP
+#define LZ4_STREAM_HPP
+
+#include <stdint.h>
+#include <array>
+
+/**
+ * @brief Streaming decoder for images packed by Tools/lz4pack.py
+ *
+ * The stream is a 16 bytes header followed by independent LZ4 blocks, each
+ * decoding to block_size bytes (the last one may be shorter):
+ *
+ *   header : magic "LZ4Q", flash offset, decoded size, ~(magic ^ offset ^ size)
+ *   block  : uint32 length (bit 31 set = stored without compression), data
+ *
+ * Compressed chunks can be fed in pieces of any size. Decoded pages are
+ * programmed as soon as they are complete, the destination is erased ahead of
+ * the write pointer (4KB aligned, blank units are left alone). A page program
+ * is left running while the next chunk is decoded. A header whose image does
+ * not fit below the flash size (or the limit handed to reset()) is rejected.
+ */
+template <uint32_t block_size = 0x1000>
+class lz4_stream
+{
+public:
+    static constexpr uint32_t magic = 0x51345A4C; // "LZ4Q"
+    static constexpr uint32_t header_size = 16;
+
+    /**
+     * @brief check whether a buffer starts with a valid stream header
+     *
+     * @param buf buffer
+     * @param size size of the buffer
+     * @return true if the header is complete and consistent
+     */
+    static bool is_stream(const uint8_t *buf, uint32_t size)
+    {
+        if (size < header_size)
+        {
+            return false;
+        }
+        const uint32_t mg = get_le32(buf);
+        return (mg == magic) && (get_le32(buf + 12) == ~(mg ^ get_le32(buf + 4) ^ get_le32(buf + 8)));
+    }
+
+    /**
+     * @brief drop any stream in progress
+     *
+     * @param limit end of the flash range a stream may write, a header past it is rejected
+     */
+    void reset(uint32_t limit = 0xFFFFFFFF)
+    {
+        _state = HEADER;
+        _fill = 0;
+        _in_flight = false;
+        _limit = limit;
+    }
+
+    /**
+     * @brief true while a stream header has been accepted and data is missing
+     */
+    bool active() const { return (_state != HEADER) && (_state != DONE) && (_state != FAILED); }
+
+    /**
+     * @brief true once the whole image is decoded, programmed and complete
+     */
+    bool done() const { return (_state == DONE) && !_in_flight; }
+
+    /**
+     * @brief flash offset and decoded size of the image, valid once the header was fed
+     */
+    uint32_t origin() const { return _origin; }
+    uint32_t size() const { return _size; }
+
+    /**
+     * @brief decode a chunk of the compressed stream
+     *
+     * @param flash flash driver, in indirect mode
+     * @param buf compressed data
+     * @param size number of bytes in buf
+     * @return int 0 if successful, error otherwise
+     */
+    template <typename flash_t>
+    int feed(flash_t &flash, const uint8_t *buf, uint32_t size)
+    {
+        while (size > 0)
+        {
+            if ((_state >= TOKEN) && (_state <= MATCH_LEN) && (_in_left == 0))
+            {
+                _state = FAILED;
+                return 1;
+            }
+            switch (_state)
+            {
+            case HEADER:
+            case BLOCK_HEADER:
+            {
+                const uint32_t need = ((_state == HEADER) ? header_size : 4) - _fill;
+                const uint32_t take = (size < need) ? size : need;
+                for (uint32_t i = 0; i < take; i++)
+                {
+                    _hdr[_fill++] = buf[i];
+                }
+                buf += take;
+                size -= take;
+                if (take == need)
+                {
+                    _fill = 0;
+                    if (((_state == HEADER) ? start_stream(flash_t::get_size()) : start_block()) != 0)
+                    {
+                        _state = FAILED;
+                        return 1;
+                    }
+                }
+                break;
+            }
+            case STORED:
+            {
+                const uint32_t take = min3(size, _in_left, block_size - _out_pos);
+                for (uint32_t i = 0; i < take; i++)
+                {
+                    _block[_out_pos++] = buf[i];
+                }
+                buf += take;
+                size -= take;
+                _in_left -= take;
+                if (_in_left == 0)
+                {
+                    _state = BLOCK_END;
+                }
+                break;
+            }
+            case TOKEN:
+            {
+                const uint8_t token = *buf++;
+                size--;
+                _in_left--;
+                _lit_len = token >> 4;
+                _match_len = token & 0x0F;
+                _state = (_lit_len == 15) ? LITERAL_LEN : LITERALS;
+                break;
+            }
+            case LITERAL_LEN:
+            case MATCH_LEN:
+            {
+                const uint8_t val = *buf++;
+                size--;
+                _in_left--;
+                if (_state == LITERAL_LEN)
+                {
+                    _lit_len += val;
+                    if (val != 255)
+                    {
+                        _state = LITERALS;
+                    }
+                }
+                else
+                {
+                    _match_len += val;
+                    if (val != 255)
+                    {
+                        _state = MATCH;
+                    }
+                }
+                break;
+            }
+            case LITERALS:
+            {
+                const uint32_t take = min3(size, _lit_len, _in_left);
+                if (take > _block_out - _out_pos)
+                {
+                    _state = FAILED;
+                    return 1;
+                }
+                for (uint32_t i = 0; i < take; i++)
+                {
+                    _block[_out_pos++] = buf[i];
+                }
+                buf += take;
+                size -= take;
+                _in_left -= take;
+                _lit_len -= take;
+                if (_lit_len == 0)
+                {
+                    /* the last sequence of a block has no match part */
+                    _state = (_in_left == 0) ? BLOCK_END : OFFSET_LO;
+                }
+                else if (_in_left == 0)
+                {
+                    _state = FAILED;
+                    return 1;
+                }
+                break;
+            }
+            case OFFSET_LO:
+                _offset = *buf++;
+                size--;
+                _in_left--;
+                _state = OFFSET_HI;
+                break;
+            case OFFSET_HI:
+                _offset |= static_cast<uint32_t>(*buf++) << 8;
+                size--;
+                _in_left--;
+                _state = (_match_len == 15) ? MATCH_LEN : MATCH;
+                break;
+            case DONE:
+                /* padding behind the stream */
+                return 0;
+            default:
+                return 1;
+            }
+            if (_state == MATCH)
+            {
+                /* the match references earlier output of the same block */
+                const uint32_t len = _match_len + 4;
+                if ((_offset == 0) || (_offset > _out_pos) || (len > _block_out - _out_pos) || (_in_left == 0))
+                {
+                    _state = FAILED;
+                    return 1;
+                }
+                for (uint32_t i = 0; i < len; i++, _out_pos++)
+                {
+                    _block[_out_pos] = _block[_out_pos - _offset];
+                }
+                _state = TOKEN;
+            }
+            if (_state == BLOCK_END)
+            {
+                if (end_block(flash) != 0)
+                {
+                    _state = FAILED;
+                    return 1;
+                }
+            }
+            else if (flush(flash, false) != 0)
+            {
+                _state = FAILED;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * @brief wait for the last page program, call once the stream is complete
+     *
+     * @param flash flash driver
+     * @return int 0 if the whole image was programmed, error otherwise
+     */
+    template <typename flash_t>
+    int finish(flash_t &flash)
+    {
+        if (_in_flight)
+        {
+            _in_flight = false;
+            if (flash.wait_ready() != 0)
+            {
+                _state = FAILED;
+            }
+        }
+        return (_state == DONE) ? 0 : 1;
+    }
+
+private:
+    enum state_t
+    {
+        HEADER = 0,
+        BLOCK_HEADER,
+        STORED,
+        TOKEN,
+        LITERAL_LEN,
+        LITERALS,
+        OFFSET_LO,
+        OFFSET_HI,
+        MATCH_LEN,
+        MATCH,
+        BLOCK_END,
+        DONE,
+        FAILED
+    };
+
+    static uint32_t get_le32(const uint8_t *buf)
+    {
+        return static_cast<uint32_t>(buf[0]) | (static_cast<uint32_t>(buf[1]) << 8) |
+               (static_cast<uint32_t>(buf[2]) << 16) | (static_cast<uint32_t>(buf[3]) << 24);
+    }
+
+    static uint32_t min3(uint32_t a, uint32_t b, uint32_t c)
+    {
+        const uint32_t m = (a < b) ? a : b;
+        return (m < c) ? m : c;
+    }
+
+    int start_stream(uint32_t flash_size)
+    {
+        if (!is_stream(_hdr.data(), header_size))
+        {
+            return 1;
+        }
+        _dest = get_le32(&_hdr[4]);
+        _left = get_le32(&_hdr[8]);
+        const uint32_t limit = (_limit < flash_size) ? _limit : flash_size;
+        /* erase ahead works on whole 4KB units, the image must fit without wrapping */
+        if (((_dest % 0x1000) != 0) || (_left > limit) || (_dest > limit - _left))
+        {
+            return 1;
+        }
+        _origin = _dest;
+        _size = _left;
+        _erased = _dest;
+        _state = (_left == 0) ? DONE : BLOCK_HEADER;
+        return 0;
+    }
+
+    int start_block()
+    {
+        const uint32_t len = get_le32(_hdr.data());
+        _in_left = len & 0x7FFFFFFF;
+        _out_pos = 0;
+        _flushed = 0;
+        _block_out = (_left < block_size) ? _left : block_size;
+        if ((_in_left == 0) || ((len & 0x80000000) && (_in_left != _block_out)))
+        {
+            return 1;
+        }
+        _state = (len & 0x80000000) ? STORED : TOKEN;
+        return 0;
+    }
+
+    template <typename flash_t>
+    int end_block(flash_t &flash)
+    {
+        if (_out_pos != _block_out)
+        {
+            return 1;
+        }
+        if (flush(flash, true) != 0)
+        {
+            return 1;
+        }
+        _left -= _block_out;
+        _state = (_left == 0) ? DONE : BLOCK_HEADER;
+        return 0;
+    }
+
+    /**
+     * @brief program the complete pages of the block buffer
+     *
+     * @param flash flash driver
+     * @param all also program the trailing partial page
+     */
+    template <typename flash_t>
+    int flush(flash_t &flash, bool all)
+    {
+        constexpr uint32_t pg = flash_t::get_pg();
+        while ((_out_pos - _flushed >= pg) || (all && (_out_pos > _flushed)))
+        {
+            uint32_t len = _out_pos - _flushed;
+            if (len > pg)
+            {
+                len = pg;
+            }
+            if (wait(flash) != 0)
+            {
+                return 1;
+            }
+            if (erase_ahead(flash, _dest + len) != 0)
+            {
+                return 1;
+            }
+            if (flash.program(reinterpret_cast<void *>(_dest), len, &_block[_flushed], false) != 0)
+            {
+                return 1;
+            }
+            _in_flight = true;
+            _dest += len;
+            _flushed += len;
+        }
+        return 0;
+    }
+
+    template <typename flash_t>
+    int wait(flash_t &flash)
+    {
+        if (!_in_flight)
+        {
+            return 0;
+        }
+        _in_flight = false;
+        return flash.wait_ready();
+    }
+
+    template <typename flash_t>
+    int erase_ahead(flash_t &flash, uint32_t upto)
+    {
+        constexpr uint32_t unit = flash_t::get_subsect_size();
+        while (_erased < upto)
+        {
+            void *adr = reinterpret_cast<void *>(_erased);
+            if (flash.blank_check(adr, unit, 0xFF) != 0)
+            {
+                if (flash.erase(adr, unit) != 0)
+                {
+                    return 1;
+                }
+            }
+            _erased += unit;
+        }
+        return 0;
+    }
+
+    state_t _state = HEADER;
+    uint32_t _fill = 0;          // bytes collected in _hdr
+    uint32_t _limit = 0xFFFFFFFF; // end of the writable range, see reset()
+    uint32_t _origin = 0;        // flash offset of the image
+    uint32_t _size = 0;          // decoded size of the image
+    uint32_t _dest = 0;          // next flash offset to program
+    uint32_t _erased = 0;        // flash is erased up to this offset
+    uint32_t _left = 0;          // decoded bytes still expected
+    uint32_t _in_left = 0;       // compressed bytes left in the current block
+    uint32_t _block_out = 0;     // decoded size of the current block
+    uint32_t _out_pos = 0;       // decoded bytes in _block
+    uint32_t _flushed = 0;       // bytes of _block already programmed
+    uint32_t _lit_len = 0;
+    uint32_t _match_len = 0;
+    uint32_t _offset = 0;
+    bool _in_flight = false;     // last page program not waited for
+    std::array<uint8_t, header_size> _hdr = {};
+    std::array<uint8_t, block_size> _block = {};
+};
+
+#endif
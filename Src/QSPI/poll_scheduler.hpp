@@ -0,0 +1,283 @@
+#ifndef POLL_SCHEDULER_HPP
+#define POLL_SCHEDULER_HPP
+
+#include <stdint.h>
+#include <array>
+#include "stm32h7xx.h"
+
+namespace cycles
+{
+    /**
+     * @brief start the DWT cycle counter
+     */
+    inline void enable()
+    {
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    }
+
+    namespace detail
+    {
+        /* cycles slept in WFI that the DWT counter did not see */
+        inline uint32_t slept;
+    }
+
+    /**
+     * @brief CPU cycles, time spent in WFI by delay() included
+     */
+    inline uint32_t now() { return DWT->CYCCNT + detail::slept; }
+
+    /**
+     * @brief wait for n CPU cycles
+     *
+     * Sleeps in WFI when interrupts are masked (the loaders) and SysTick is
+     * free: the pending SysTick wakes the core without taking the exception.
+     * Otherwise the DWT counter is polled.
+     *
+     * @param n number of CPU cycles
+     */
+    inline void delay(uint32_t n)
+    {
+        constexpr uint32_t wfi_min = 20000;
+        if ((n > wfi_min) && (__get_PRIMASK() != 0) && ((SysTick->CTRL & SysTick_CTRL_ENABLE_Msk) == 0))
+        {
+            /* keep the debug access alive in sleep, the debugger halts the loaders at any time */
+            DBGMCU->CR |= DBGMCU_CR_DBG_SLEEPD1;
+            while (n > wfi_min)
+            {
+                const uint32_t chunk = (n > SysTick_LOAD_RELOAD_Msk) ? SysTick_LOAD_RELOAD_Msk : n;
+                const uint32_t seen = DWT->CYCCNT;
+                SysTick->LOAD = chunk - 1;
+                SysTick->VAL = 0;
+                SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+                while ((SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk) == 0)
+                {
+                    __WFI();
+                }
+                SysTick->CTRL = 0;
+                SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+                const uint32_t counted = DWT->CYCCNT - seen;
+                if (counted < chunk)
+                {
+                    detail::slept += chunk - counted;
+                }
+                n -= chunk;
+            }
+        }
+        const uint32_t start = now();
+        while ((now() - start) < n)
+        {
+        }
+    }
+}
+
+/**
+ * @brief Predictive status polling for program/erase/status write/reset operations
+ *
+ * Every operation has a predicted duration, seeded with the typical time of
+ * the part traits. Waiting first sleeps 3/4 of the prediction without touching
+ * the bus, then the status register is auto-polled with an interval of 1/16 of
+ * the prediction. The measured time updates the prediction (1/8 weight).
+ * The predictions survive configure(), an operation that completes in a later
+ * loader call is not learned: the DWT counter stops while the core is halted.
+ *
+ * Without configure() (clock unknown) no time is predicted and the status
+ * register is polled with the minimal interval.
+ */
+template <typename traits>
+class poll_scheduler
+{
+public:
+    enum op_t
+    {
+        WEL = 0,
+        PAGE_PROGRAM,
+        SUBSECTOR_ERASE,
+        SECTOR_ERASE,
+        CHIP_ERASE,
+        STATUS_WRITE,
+        RESET,
+        OP_MAX,
+        OP_NONE = OP_MAX
+    };
+
+    /**
+     * @brief enable predictions, the first call seeds them with the typical times
+     *
+     * The loaders bring the flash up again after every lost state, the learned
+     * predictions are kept across these calls.
+     *
+     * @param cpu_hz CPU clock
+     * @param sck_hz flash clock
+     */
+    static void configure(uint32_t cpu_hz, uint32_t sck_hz)
+    {
+        cycles::enable();
+        _state.cpu_per_us = cpu_hz / 1000000UL;
+        _state.sck_per_us = sck_hz / 1000000UL;
+        _state.op = OP_NONE;
+        if (_state.magic != seeded_magic)
+        {
+            for (uint32_t i = 0; i < OP_MAX; i++)
+            {
+                _state.predicted_us[i] = typical_us(static_cast<op_t>(i));
+            }
+            _state.magic = seeded_magic;
+        }
+    }
+
+    /**
+     * @brief record the start of an operation, right after its command is sent
+     */
+    static void start(op_t op)
+    {
+        _state.op = op;
+        _state.timed = true;
+        _state.start = cycles::now();
+    }
+
+    /**
+     * @brief the running operation completes in a later loader call
+     *
+     * It is still waited for, but the time the core spends halted between the
+     * calls is not counted: its duration is not learned and the wait does not
+     * sleep, the operation most likely completed while the core was halted.
+     */
+    static void defer() { _state.timed = false; }
+
+    /**
+     * @brief sleep the predicted minimum of the running operation
+     *
+     * A deferred operation is not slept for, its status is read right away
+     * and then polled with the minimal interval.
+     *
+     * @return uint16_t auto-polling interval in flash clock cycles
+     */
+    static uint16_t prepare()
+    {
+        if ((_state.op >= OP_NONE) || (_state.cpu_per_us == 0) || !_state.timed)
+        {
+            return min_interval;
+        }
+        const uint32_t predicted = _state.predicted_us[_state.op];
+        const uint32_t elapsed = (cycles::now() - _state.start) / _state.cpu_per_us;
+        const uint32_t min_wait = predicted - predicted / 4;
+        /* one second slices keep the cycle count inside 32 bits */
+        for (uint32_t left = (elapsed < min_wait) ? (min_wait - elapsed) : 0; left > 0;)
+        {
+            const uint32_t slice = (left > 1000000UL) ? 1000000UL : left;
+            cycles::delay(slice * _state.cpu_per_us);
+            left -= slice;
+        }
+        const uint32_t interval = (predicted / 16) * _state.sck_per_us;
+        if (interval < min_interval)
+        {
+            return min_interval;
+        }
+        return (interval > 0xFFFF) ? 0xFFFF : static_cast<uint16_t>(interval);
+    }
+
+    /**
+     * @brief feed the measured duration back into the prediction
+     */
+    static void complete()
+    {
+        /* the cycle counter wraps after ~10s at 400MHz, chip erase is not learned */
+        if ((_state.op >= OP_NONE) || (_state.cpu_per_us == 0) || !_state.timed ||
+            (max_us(_state.op) > 0xFFFFFFFFUL / _state.cpu_per_us))
+        {
+            _state.op = OP_NONE;
+            return;
+        }
+        const uint32_t observed = (cycles::now() - _state.start) / _state.cpu_per_us;
+        uint32_t &predicted = _state.predicted_us[_state.op];
+        predicted = predicted - predicted / 8 + observed / 8;
+        if (predicted > max_us(_state.op))
+        {
+            predicted = max_us(_state.op);
+        }
+        _state.op = OP_NONE;
+    }
+
+    /**
+     * @brief wait a fixed chip timing (tDP, tRES1)
+     *
+     * Without configure() the fastest STM32H7 core clock is assumed.
+     */
+    static void delay_us(uint32_t us)
+    {
+        cycles::enable();
+        cycles::delay(us * ((_state.cpu_per_us != 0) ? _state.cpu_per_us : 480));
+    }
+
+    /**
+     * @brief forget the running operation without updating its prediction
+     */
+    static void drop() { _state.op = OP_NONE; }
+
+    /**
+     * @brief current prediction, for tuning
+     */
+    static uint32_t predicted_us(op_t op) { return _state.predicted_us[op]; }
+
+private:
+    static constexpr uint16_t min_interval = 0x10;
+    static constexpr uint32_t seeded_magic = 0x50524544; // "PRED"
+
+    static constexpr uint32_t typical_us(op_t op)
+    {
+        switch (op)
+        {
+        case PAGE_PROGRAM:
+            return traits::t_pp_typ;
+        case SUBSECTOR_ERASE:
+            return traits::t_se_typ;
+        case SECTOR_ERASE:
+            return traits::t_be_typ;
+        case CHIP_ERASE:
+            return traits::t_ce_typ;
+        case STATUS_WRITE:
+            return traits::t_w_typ;
+        case RESET:
+            return traits::t_rst;
+        default:
+            return 0;
+        }
+    }
+
+    static constexpr uint32_t max_us(op_t op)
+    {
+        switch (op)
+        {
+        case PAGE_PROGRAM:
+            return traits::t_pp_max;
+        case SUBSECTOR_ERASE:
+            return traits::t_se_max;
+        case SECTOR_ERASE:
+            return traits::t_be_max;
+        case CHIP_ERASE:
+            return traits::t_ce_max;
+        case STATUS_WRITE:
+            return traits::t_w_max;
+        case RESET:
+            return traits::t_rst;
+        default:
+            return 0;
+        }
+    }
+
+    struct state_t
+    {
+        uint32_t magic; // seeded_magic once the predictions hold valid times
+        uint32_t cpu_per_us;
+        uint32_t sck_per_us;
+        op_t op;        // operation being waited for
+        bool timed;     // started in the current loader call
+        uint32_t start; // cycles::now() when its command was sent
+        std::array<uint32_t, OP_MAX> predicted_us;
+    };
+    /* the loaders have no startup code, the predictions are tracked by magic instead of zero init */
+    inline static state_t _state;
+};
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef POWER_MANAGER_HPP
+#define POWER_MANAGER_HPP
+
+#include <stdint.h>
+#include "stm32h7xx.h"
+#include "QspiFlash.hpp"
+#include "poll_scheduler.hpp"
+
+/**
+ * @brief Puts the flash into deep power-down when idle and wakes it on demand
+ *
+ * The application switches modes through the manager (mmap()/indirect()) and
+ * calls acquire() before touching the flash, poll() from its idle loop. Once
+ * the flash was not acquired for the idle timeout (and is not busy) it enters
+ * deep power-down. acquire() releases it, which only costs tRES1: the status
+ * registers (QE) survive power-down so no reset and no re-init is needed. A
+ * flash that was memory mapped is mapped again.
+ *
+ * The wake time is measured from the release command to the completion of
+ * the first read (through the mapped window, or a status read in indirect
+ * mode).
+ *
+ * The idle time is summed up in 64 bits by poll(), the timeout may exceed the
+ * wrap of the cycle counter (~9s at 480MHz) as long as poll() runs more often.
+ */
+template <QspiFlash flash_t>
+class power_manager
+{
+public:
+    struct stats_t
+    {
+        uint32_t sleeps;     // deep power-down entries
+        uint32_t wakes;      // releases
+        uint32_t last_wake;  // cycles from release to first read, last wake
+        uint32_t max_wake;   // worst wake seen
+    };
+
+    /**
+     * @param flash flash driver, initialized and in indirect mode
+     * @param idle_cycles CPU cycles without acquire() before powering down
+     */
+    power_manager(flash_t &flash, uint64_t idle_cycles) : _flash(flash), _idle(idle_cycles)
+    {
+        _stamp = cycles::now();
+    }
+
+    /**
+     * @brief make sure the flash is awake, restart the idle timer
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int acquire()
+    {
+        _stamp = cycles::now();
+        _idle_for = 0;
+        if (!_down)
+        {
+            return 0;
+        }
+        const uint32_t start = cycles::now();
+        auto res = _flash.release();
+        if (res != 0)
+        {
+            return res;
+        }
+        _down = false;
+        if (_remap)
+        {
+            _remap = false;
+            res = _flash.mmap();
+            if (res != 0)
+            {
+                return res;
+            }
+            volatile const uint32_t *first = reinterpret_cast<volatile const uint32_t *>(QSPI_BASE);
+            SCB_InvalidateDCache_by_Addr(const_cast<uint32_t *>(first), 32);
+            (void)*first;
+        }
+        else
+        {
+            bool busy = false;
+            res = _flash.is_busy(busy);
+            if (res != 0)
+            {
+                return res;
+            }
+        }
+        _stats.last_wake = cycles::now() - start;
+        _stats.max_wake = (_stats.last_wake > _stats.max_wake) ? _stats.last_wake : _stats.max_wake;
+        _stats.wakes++;
+        return 0;
+    }
+
+    /**
+     * @brief enter power-down once the idle timeout expired, call from the idle loop
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int poll()
+    {
+        const uint32_t now = cycles::now();
+        _idle_for += now - _stamp;
+        _stamp = now;
+        if (_down || (_idle_for < _idle))
+        {
+            return 0;
+        }
+        return sleep();
+    }
+
+    /**
+     * @brief enter power-down now, the mapped state is restored by acquire()
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int sleep()
+    {
+        if (_down)
+        {
+            return 0;
+        }
+        const bool mapped = flash_t::is_mapped();
+        auto res = _flash.ensure_indirect();
+        if (res != 0)
+        {
+            return res;
+        }
+        bool busy = false;
+        res = _flash.is_busy(busy);
+        if ((res == 0) && !busy)
+        {
+            res = _flash.sleep();
+            _down = (res == 0);
+            _stats.sleeps += _down ? 1 : 0;
+        }
+        _remap = _down && mapped;
+        if (!_down && mapped)
+        {
+            /* program/erase still running: stay awake, as we were */
+            auto mres = _flash.mmap();
+            res = (res != 0) ? res : mres;
+        }
+        return res;
+    }
+
+    /**
+     * @brief switch to memory mapped mode, remembered across power-down
+     */
+    int mmap()
+    {
+        auto res = acquire();
+        return (res != 0) ? res : _flash.ensure_mapped();
+    }
+
+    /**
+     * @brief switch to indirect mode (program, erase, indirect reads)
+     */
+    int indirect()
+    {
+        auto res = acquire();
+        return (res != 0) ? res : _flash.ensure_indirect();
+    }
+
+    bool is_down() const { return _down; }
+    /* the mode the flash is in, or is put back into by acquire() */
+    bool is_mapped() const { return _down ? _remap : flash_t::is_mapped(); }
+    const stats_t &stats() const { return _stats; }
+
+private:
+    flash_t &_flash;
+    const uint64_t _idle;
+    uint32_t _stamp;        // cycles::now() of the last acquire() or poll()
+    uint64_t _idle_for = 0; // cycles since the last acquire()
+    bool _down = false;     // in deep power-down
+    bool _remap = false;    // mapped when it went down, mapped again by acquire()
+    stats_t _stats = {};
+};
+
+#endif
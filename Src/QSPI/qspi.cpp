@@ -87,22 +87,43 @@ qspi_driver::error_t qspi_driver::poll(const qspi_driver::polling_t &poll)
  */
 qspi_driver::error_t qspi_driver::write(const qspi_driver::transact_t &transaction)
 {
+    const segment_t seg = {transaction.data.buf, transaction.data.size};
+    return write(transaction.header, transaction.data.mode, &seg, 1);
+}
+
+/**
+ * @brief scatter-gather write, the segments form the data phase of one command
+ *
+ * @param header instruction, address, alternate bytes
+ * @param data_mode lines used by the data phase
+ * @param segs data segments, sent in order
+ * @param count number of segments
+ * @return qspi_driver::error_t QSPI_OK if successful, error otherwise
+ */
+qspi_driver::error_t qspi_driver::write(const qspi_driver::header_t &header, qspi_driver::cmd_data_mode data_mode,
+                                        const qspi_driver::segment_t *segs, uint32_t count)
+{
+    uint32_t total = 0;
+    for (uint32_t s = 0; s < count; s++)
+    {
+        total += segs[s].size;
+    }
     while (_ptr->SR & QUADSPI_SR_BUSY)
     {
     }
     // Instruction phase
-    if (transaction.data.size > 0)
+    if (total > 0)
     {
-        _ptr->DLR = transaction.data.size - 1;
+        _ptr->DLR = total - 1;
     }
-    set_header(transaction.header, transaction.data.mode, INDIRECT_WRITE);
-    _ptr->ABR = transaction.header.alternative_byte.alternate_bytes;
+    set_header(header, data_mode, INDIRECT_WRITE);
+    _ptr->ABR = header.alternative_byte.alternate_bytes;
     // Address phase
-    _ptr->AR = transaction.header.address.address;
+    _ptr->AR = header.address.address;
     // Data phase
-    if (transaction.data.size > 0)
+    for (uint32_t s = 0; s < count; s++)
     {
-        for (uint32_t i = 0; i < transaction.data.size; i++)
+        for (uint32_t i = 0; i < segs[s].size; i++)
         {
             while ((_ptr->SR & QUADSPI_SR_FTF) == 0)
             {
@@ -112,7 +133,7 @@ qspi_driver::error_t qspi_driver::write(const qspi_driver::transact_t &transacti
                     return res;
                 }
             }
-            *((__IO uint8_t *)&_ptr->DR) = transaction.data.buf[i];
+            *((__IO uint8_t *)&_ptr->DR) = segs[s].buf[i];
         }
     }
     while ((_ptr->SR & QUADSPI_SR_TCF) == 0)
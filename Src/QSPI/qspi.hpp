@@ -75,6 +75,12 @@ public:
         uint8_t *buf;
         uint32_t size;
     };
+    /* one piece of a scatter-gather data phase */
+    struct segment_t
+    {
+        const uint8_t *buf;
+        uint32_t size;
+    };
     struct header_t
     {
         instruction_t instruction;
@@ -144,6 +150,7 @@ public:
     error_t mmap(const qspi_driver::memmap_t &transaction);
     error_t poll(const polling_t &poll);
     error_t write(const transact_t &transaction);
+    error_t write(const header_t &header, cmd_data_mode data_mode, const segment_t *segs, uint32_t count);
     error_t read(transact_t &transaction);
     static constexpr uint8_t get_fsize(uint32_t value)
     {
@@ -0,0 +1,175 @@
+#ifndef READ_CACHE_HPP
+#define READ_CACHE_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include "QspiFlash.hpp"
+
+/**
+ * @brief LRU cache of flash lines in RAM, for reads while the chip is busy
+ *
+ * Used in indirect mode, when the mapped window is not available. A hit is
+ * copied from RAM without touching the bus, even while a program or erase is
+ * running. A miss waits for the running operation, reads the whole line and
+ * replaces the least recently used one.
+ *
+ * Program and erase through the cache (or call invalidate()) so stale lines
+ * are dropped.
+ */
+template <QspiFlash flash_t, uint32_t lines = 16, uint32_t line_size = flash_t::get_pg()>
+class read_cache
+{
+    static_assert((line_size & (line_size - 1)) == 0, "line size must be a power of 2");
+
+public:
+    read_cache(flash_t &flash) : _flash(flash) { invalidate(); }
+
+    /**
+     * @brief read through the cache
+     *
+     * @param src flash offset
+     * @param size number of bytes
+     * @param dst destination buffer
+     * @return int 0 if successful, error otherwise
+     */
+    int read(uint32_t src, uint32_t size, uint8_t *dst)
+    {
+        while (size > 0)
+        {
+            const uint32_t tag = src & ~(line_size - 1);
+            const uint32_t off = src - tag;
+            uint32_t chunk = line_size - off;
+            if (chunk > size)
+            {
+                chunk = size;
+            }
+            line_t *line = lookup(tag);
+            if (line == nullptr)
+            {
+                _misses++;
+                line = victim();
+                line->valid = false;
+                auto res = _flash.wait_ready();
+                if (res == 0)
+                {
+                    res = _flash.read(reinterpret_cast<void *>(tag), line_size, line->data.data());
+                }
+                if (res != 0)
+                {
+                    return res;
+                }
+                line->tag = tag;
+                line->valid = true;
+            }
+            else
+            {
+                _hits++;
+            }
+            line->used = ++_clock;
+            memcpy(dst, &line->data[off], chunk);
+            src += chunk;
+            dst += chunk;
+            size -= chunk;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief flash_t::program() dropping the lines it changes
+     */
+    int program(uint32_t dest, uint32_t size, const uint8_t *src, bool wait = true)
+    {
+        invalidate(dest, size);
+        return _flash.program(reinterpret_cast<void *>(dest), size, const_cast<uint8_t *>(src), wait);
+    }
+
+    /**
+     * @brief flash_t::erase() dropping the lines of the erase unit
+     */
+    int erase(uint32_t adr, uint32_t size, bool wait = true)
+    {
+        invalidate(adr - (adr % size), size);
+        return _flash.erase(reinterpret_cast<void *>(adr), size, wait);
+    }
+
+    /**
+     * @brief drop the lines overlapping [adr, adr + size)
+     */
+    void invalidate(uint32_t adr, uint32_t size)
+    {
+        for (auto &line : _lines)
+        {
+            if (line.valid && (line.tag < adr + size) && (adr < line.tag + line_size))
+            {
+                line.valid = false;
+            }
+        }
+    }
+
+    /**
+     * @brief drop every line
+     */
+    void invalidate()
+    {
+        for (auto &line : _lines)
+        {
+            line.valid = false;
+        }
+    }
+
+    uint32_t hits() const { return _hits; }
+    uint32_t misses() const { return _misses; }
+    void reset_stats()
+    {
+        _hits = 0;
+        _misses = 0;
+    }
+
+private:
+    struct line_t
+    {
+        uint32_t tag;  // flash offset of the line
+        uint32_t used; // _clock at the last access
+        bool valid;
+        std::array<uint8_t, line_size> data;
+    };
+
+    line_t *lookup(uint32_t tag)
+    {
+        for (auto &line : _lines)
+        {
+            if (line.valid && (line.tag == tag))
+            {
+                return &line;
+            }
+        }
+        return nullptr;
+    }
+
+    line_t *victim()
+    {
+        line_t *lru = &_lines[0];
+        for (auto &line : _lines)
+        {
+            if (!line.valid)
+            {
+                return &line;
+            }
+            /* wrap safe age compare */
+            if (static_cast<int32_t>(line.used - lru->used) < 0)
+            {
+                lru = &line;
+            }
+        }
+        return lru;
+    }
+
+    flash_t &_flash;
+    uint32_t _clock = 0;
+    uint32_t _hits = 0;
+    uint32_t _misses = 0;
+    std::array<line_t, lines> _lines;
+};
+
+#endif
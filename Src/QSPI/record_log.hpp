@@ -0,0 +1,491 @@
+#ifndef RECORD_LOG_HPP
+#define RECORD_LOG_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include "stm32h7xx.h"
+#include "QspiFlash.hpp"
+
+/**
+ * @brief Append-only log of keyed records (timestamps) with O(log n) seek
+ *
+ * The region is a ring of 64KB sectors. The first pages of a sector hold its
+ * header and a sparse index, the other pages hold records:
+ *
+ *   header : magic "LOGQ", sequence, ~(magic ^ sequence), reserved
+ *   index  : first key of every data page, programmed with the first bytes
+ *            of the page (0xFFFFFFFF while the page is empty)
+ *   record : key, length (16 bits), data; records never cross a page, the
+ *            rest of a page stays erased
+ *
+ * Keys must not decrease. Records are batched in a RAM page, a page is
+ * programmed when the next record does not fit or on flush(); a flushed
+ * partial page is completed later by programming its erased tail, nothing is
+ * ever read back and rewritten. When the ring is full the oldest sector is
+ * erased and reused.
+ *
+ * seek() binary searches the first keys of the sectors, then the page index
+ * of one sector and scans a single page, everything through the memory
+ * mapped window. The flash is switched between indirect and mapped mode as
+ * needed, release() leaves it in indirect mode.
+ */
+template <QspiFlash flash_t>
+class record_log
+{
+public:
+    static constexpr uint32_t sect = flash_t::get_sect_size();
+    static constexpr uint32_t pg = flash_t::get_pg();
+    static constexpr uint32_t header_size = 16;
+    static constexpr uint32_t rec_header = 6;
+    /* smallest n with header_size + 4 * (sect / pg - n) <= n * pg */
+    static constexpr uint32_t index_pages = (header_size + 4 * (sect / pg) + pg + 3) / (pg + 4);
+    static constexpr uint32_t data_pages = sect / pg - index_pages;
+    static constexpr uint32_t max_record = pg - rec_header;
+
+    struct cursor_t
+    {
+        uint32_t sector; // logical sector, 0 = oldest
+        uint32_t page;   // data page in the sector
+        uint32_t off;    // offset in the page
+    };
+
+    /**
+     * @param flash flash driver, in indirect mode
+     * @param start flash offset of the region, sector aligned
+     * @param sectors number of sectors in the ring, at least 2
+     */
+    record_log(flash_t &flash, uint32_t start, uint32_t sectors) : _flash(flash), _start(start), _sectors(sectors) {}
+
+    /**
+     * @brief erase the region
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int format()
+    {
+        auto res = _flash.ensure_indirect();
+        for (uint32_t s = 0; (s < _sectors) && (res == 0); s++)
+        {
+            res = _flash.erase_sector(reinterpret_cast<void *>(_start + s * sect));
+        }
+        _count = 0;
+        _fill = 0;
+        _flushed = 0;
+        _last_key = 0;
+        return res;
+    }
+
+    /**
+     * @brief find the ring and the append position
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int mount()
+    {
+        auto res = _flash.ensure_mapped();
+        if (res != 0)
+        {
+            return res;
+        }
+        SCB_InvalidateDCache_by_Addr(reinterpret_cast<void *>(QSPI_BASE + _start), _sectors * sect);
+        _count = 0;
+        _fill = 0;
+        _flushed = 0;
+        _last_key = 0;
+        uint32_t newest = 0;
+        for (uint32_t s = 0; s < _sectors; s++)
+        {
+            uint32_t seq;
+            if (sector_seq(s, seq) && ((_count == 0) || (static_cast<int32_t>(seq - _head_seq) > 0)))
+            {
+                newest = s;
+                _head_seq = seq;
+                _count = 1;
+            }
+        }
+        if (_count == 0)
+        {
+            return 0;
+        }
+        /* older sectors directly precede the newest one */
+        for (uint32_t k = 1; k < _sectors; k++)
+        {
+            uint32_t seq;
+            if (!sector_seq((newest + _sectors - k) % _sectors, seq) || (seq != _head_seq - k))
+            {
+                break;
+            }
+            _count++;
+        }
+        _head = newest;
+        /* last page with an index entry, then the end of its records */
+        const uint32_t used = last_page_before(newest, 0xFFFFFFFF) + 1;
+        _page_no = (used == 0) ? 0 : (used - 1);
+        const uint8_t *page = window(page_addr(_head, _page_no));
+        const uint32_t off = page_end(page, _last_key);
+        memcpy(_page.data(), page, off);
+        _fill = off;
+        _flushed = off;
+        if ((used == 0) && (_count > 1))
+        {
+            /* fresh head sector, the last key is in the previous one */
+            const uint32_t prev = physical(_count - 2);
+            const uint32_t last = last_page_before(prev, 0xFFFFFFFF);
+            if (last != none)
+            {
+                page_end(window(page_addr(prev, last)), _last_key);
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * @brief append a record
+     *
+     * @param key key, not lower than the previous one
+     * @param data record data
+     * @param len length, at most max_record
+     * @return int 0 if successful, error otherwise
+     */
+    int append(uint32_t key, const void *data, uint32_t len)
+    {
+        if ((key == 0xFFFFFFFF) || (key < _last_key) || (len > max_record))
+        {
+            return 1;
+        }
+        if (_count == 0)
+        {
+            auto res = open_sector(0, 0);
+            if (res != 0)
+            {
+                return res;
+            }
+        }
+        if (_fill + rec_header + len > pg)
+        {
+            auto res = flush();
+            if (res != 0)
+            {
+                return res;
+            }
+            _fill = 0;
+            _flushed = 0;
+            if (++_page_no == data_pages)
+            {
+                res = open_sector((_head + 1) % _sectors, _head_seq + 1);
+                if (res != 0)
+                {
+                    return res;
+                }
+            }
+        }
+        put_le32(&_page[_fill], key);
+        _page[_fill + 4] = static_cast<uint8_t>(len);
+        _page[_fill + 5] = static_cast<uint8_t>(len >> 8);
+        memcpy(&_page[_fill + rec_header], data, len);
+        _fill += rec_header + len;
+        _last_key = key;
+        return 0;
+    }
+
+    /**
+     * @brief program the records still held in RAM
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int flush()
+    {
+        if (_fill == _flushed)
+        {
+            return 0;
+        }
+        auto res = _flash.ensure_indirect();
+        if ((res == 0) && (_flushed == 0))
+        {
+            /* index entry: first key of the page */
+            res = program(_start + _head * sect + header_size + 4 * _page_no, 4, _page.data());
+        }
+        if (res == 0)
+        {
+            res = program(page_addr(_head, _page_no) + _flushed, _fill - _flushed, &_page[_flushed]);
+        }
+        if (res == 0)
+        {
+            _flushed = _fill;
+        }
+        return res;
+    }
+
+    /**
+     * @brief position a cursor on the first record with a key not lower than key
+     *
+     * @return int 0 if successful (the cursor may be at the end), error otherwise
+     */
+    int seek(uint32_t key, cursor_t &cur)
+    {
+        cur = {0, 0, 0};
+        auto res = flush();
+        if (res == 0)
+        {
+            res = _flash.ensure_mapped();
+        }
+        if ((res != 0) || (_count == 0))
+        {
+            return res;
+        }
+        /* last sector starting below key (a run of equal keys may begin before it) */
+        uint32_t lo = 0;
+        uint32_t hi = _count;
+        while (hi - lo > 1)
+        {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            if (first_key(physical(mid), 0) < key)
+            {
+                lo = mid;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        cur.sector = lo;
+        const uint32_t page = last_page_before(physical(lo), key);
+        cur.page = (page == none) ? 0 : page;
+        /* then forward through at most a page or two */
+        while (true)
+        {
+            cursor_t at = cur;
+            uint32_t k;
+            uint32_t len;
+            if ((step(at, k, len) != 0) || (k >= key))
+            {
+                return 0;
+            }
+            cur = at;
+            cur.off += rec_header + len;
+        }
+    }
+
+    /**
+     * @brief read the record at the cursor and advance
+     *
+     * @param cur cursor from seek()
+     * @param key set to the record key
+     * @param buf destination, the data is truncated to size
+     * @param size size of buf
+     * @param len set to the record length
+     * @return int 0 if a record was read, 1 at the end of the log, error otherwise
+     */
+    int read(cursor_t &cur, uint32_t &key, void *buf, uint32_t size, uint32_t &len)
+    {
+        auto res = _flash.ensure_mapped();
+        if (res != 0)
+        {
+            return res;
+        }
+        if (step(cur, key, len) != 0)
+        {
+            return 1;
+        }
+        const uint8_t *rec = window(page_addr(physical(cur.sector), cur.page) + cur.off);
+        memcpy(buf, rec + rec_header, (len < size) ? len : size);
+        cur.off += rec_header + len;
+        return 0;
+    }
+
+    /**
+     * @brief leave the flash in indirect mode
+     */
+    int release() { return _flash.ensure_indirect(); }
+
+    /**
+     * @brief sectors holding records
+     */
+    uint32_t sectors_used() const { return _count; }
+
+private:
+    static constexpr uint32_t magic = 0x51474F4C; // "LOGQ"
+    static constexpr uint32_t none = 0xFFFFFFFF;
+    static_assert(header_size + 4 * data_pages <= index_pages * pg, "index does not fit");
+
+    static uint32_t get_le32(const uint8_t *buf)
+    {
+        return static_cast<uint32_t>(buf[0]) | (static_cast<uint32_t>(buf[1]) << 8) |
+               (static_cast<uint32_t>(buf[2]) << 16) | (static_cast<uint32_t>(buf[3]) << 24);
+    }
+
+    static uint32_t get_le16(const uint8_t *buf) { return buf[0] | (static_cast<uint32_t>(buf[1]) << 8); }
+
+    static void put_le32(uint8_t *buf, uint32_t val)
+    {
+        buf[0] = static_cast<uint8_t>(val);
+        buf[1] = static_cast<uint8_t>(val >> 8);
+        buf[2] = static_cast<uint8_t>(val >> 16);
+        buf[3] = static_cast<uint8_t>(val >> 24);
+    }
+
+    static const uint8_t *window(uint32_t off) { return reinterpret_cast<const uint8_t *>(QSPI_BASE + off); }
+
+    /**
+     * @brief true if a complete record starts at off of a page
+     */
+    static bool record_at(const uint8_t *page, uint32_t off)
+    {
+        return (off + rec_header <= pg) && (get_le32(page + off) != 0xFFFFFFFF) &&
+               (off + rec_header + get_le16(page + off + 4) <= pg);
+    }
+
+    /**
+     * @brief offset past the last record of a page, key of that record in last
+     */
+    static uint32_t page_end(const uint8_t *page, uint32_t &last)
+    {
+        uint32_t off = 0;
+        while (record_at(page, off))
+        {
+            last = get_le32(page + off);
+            off += rec_header + get_le16(page + off + 4);
+        }
+        return off;
+    }
+
+    uint32_t physical(uint32_t logical) const { return (_head + _sectors + 1 - _count + logical) % _sectors; }
+
+    uint32_t page_addr(uint32_t sector, uint32_t page) const
+    {
+        return _start + sector * sect + (index_pages + page) * pg;
+    }
+
+    uint32_t first_key(uint32_t sector, uint32_t page) const
+    {
+        return get_le32(window(_start + sector * sect + header_size + 4 * page));
+    }
+
+    bool sector_seq(uint32_t sector, uint32_t &seq) const
+    {
+        const uint8_t *hdr = window(_start + sector * sect);
+        seq = get_le32(hdr + 4);
+        return (get_le32(hdr) == magic) && (get_le32(hdr + 8) == ~(magic ^ seq));
+    }
+
+    /**
+     * @brief binary search of the page index, last page whose first key is below key
+     *
+     * Empty pages read 0xFFFFFFFF, with key 0xFFFFFFFF this is the last used page.
+     *
+     * @return uint32_t page, none if there is none
+     */
+    uint32_t last_page_before(uint32_t sector, uint32_t key) const
+    {
+        uint32_t lo = 0;
+        uint32_t hi = data_pages;
+        while (lo < hi)
+        {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            if (first_key(sector, mid) < key)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        return (lo == 0) ? none : (lo - 1);
+    }
+
+    /**
+     * @brief move the cursor onto the next record, without consuming it
+     *
+     * @return int 0 if a record is at the cursor, 1 at the end of the log
+     */
+    int step(cursor_t &cur, uint32_t &key, uint32_t &len) const
+    {
+        while (cur.sector < _count)
+        {
+            const uint32_t sector = physical(cur.sector);
+            const bool head = (cur.sector + 1 == _count);
+            if (head && ((cur.page > _page_no) || ((cur.page == _page_no) && (cur.off >= _flushed))))
+            {
+                return 1;
+            }
+            const uint8_t *page = window(page_addr(sector, cur.page));
+            if (record_at(page, cur.off))
+            {
+                key = get_le32(page + cur.off);
+                len = get_le16(page + cur.off + 4);
+                return 0;
+            }
+            cur.off = 0;
+            if (++cur.page == data_pages)
+            {
+                cur.page = 0;
+                cur.sector++;
+            }
+        }
+        return 1;
+    }
+
+    /**
+     * @brief erase a sector if needed and make it the head of the ring
+     */
+    int open_sector(uint32_t sector, uint32_t seq)
+    {
+        auto res = _flash.ensure_mapped();
+        if (res != 0)
+        {
+            return res;
+        }
+        const uint8_t *win = window(_start + sector * sect);
+        bool blank = true;
+        for (uint32_t i = 0; (i < sect) && blank; i += 4)
+        {
+            blank = (get_le32(win + i) == 0xFFFFFFFF);
+        }
+        res = _flash.ensure_indirect();
+        if ((res == 0) && !blank)
+        {
+            res = _flash.erase_sector(reinterpret_cast<void *>(_start + sector * sect));
+        }
+        std::array<uint8_t, 12> hdr;
+        put_le32(&hdr[0], magic);
+        put_le32(&hdr[4], seq);
+        put_le32(&hdr[8], ~(magic ^ seq));
+        if (res == 0)
+        {
+            res = program(_start + sector * sect, hdr.size(), hdr.data());
+        }
+        if (res != 0)
+        {
+            return res;
+        }
+        /* the oldest sector was reused when the ring is full */
+        _count = (_count < _sectors) ? (_count + 1) : _sectors;
+        _head = sector;
+        _head_seq = seq;
+        _page_no = 0;
+        _fill = 0;
+        _flushed = 0;
+        return 0;
+    }
+
+    int program(uint32_t adr, uint32_t size, const uint8_t *src)
+    {
+        return _flash.program(reinterpret_cast<void *>(adr), size, const_cast<uint8_t *>(src));
+    }
+
+    flash_t &_flash;
+    const uint32_t _start;
+    const uint32_t _sectors;
+    uint32_t _count = 0;    // sectors in the ring, the newest is _head
+    uint32_t _head = 0;     // sector appended to
+    uint32_t _head_seq = 0;
+    uint32_t _page_no = 0;  // data page of _page in _head
+    uint32_t _fill = 0;     // bytes in _page
+    uint32_t _flushed = 0;  // bytes of _page already programmed
+    uint32_t _last_key = 0;
+    std::array<uint8_t, pg> _page;
+};
+
+#endif
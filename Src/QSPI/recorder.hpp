@@ -0,0 +1,228 @@
+#ifndef RECORDER_HPP
+#define RECORDER_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include "QspiFlash.hpp"
+#include "poll_scheduler.hpp"
+
+/**
+ * @brief Continuous capture into a flash region, fed from an ISR or DMA callback
+ *
+ * The producer calls push() (single producer, lock free), the main loop calls
+ * service() as often as it can. service() never waits for the chip: while a
+ * program or erase runs it returns at once, otherwise it starts the next step:
+ *   - program one page from the ring (the wrap of the ring is sent as a second
+ *     segment, no copy) into an erased sector
+ *   - erase the next sector when fewer than erase_ahead sectors are erased
+ *     ahead of the write pointer and the ring is less than half full, or
+ *     when no erased page is left
+ * Sectors are erased with the 64KB command, the ring has to absorb one sector
+ * erase at the capture rate.
+ *
+ * Recording is linear through the region and stops when the region is full.
+ * The flash is expected in indirect mode while recording.
+ */
+template <QspiFlash flash_t, uint32_t ring_size = 0x4000>
+class recorder
+{
+    static_assert((ring_size & (ring_size - 1)) == 0, "ring size must be a power of 2");
+
+public:
+    struct stats_t
+    {
+        uint32_t bytes;         // bytes programmed
+        uint32_t dropped;       // bytes refused by push(), ring full
+        uint32_t max_occupancy; // worst ring fill seen by push()
+        uint32_t erases;        // sectors erased
+        uint64_t cycles;        // CPU cycles from the first to the last page program
+    };
+
+    /**
+     * @param flash flash driver, in indirect mode
+     * @param start flash offset of the region, sector aligned
+     * @param size size of the region, multiple of the sector size
+     * @param erase_ahead erased sectors to keep ahead of the write pointer
+     */
+    recorder(flash_t &flash, uint32_t start, uint32_t size, uint32_t erase_ahead = 2)
+        : _flash(flash), _start(start), _end(start + size), _ahead(erase_ahead * sect)
+    {
+        reset();
+    }
+
+    /**
+     * @brief restart at the beginning of the region, the region is erased again
+     */
+    void reset()
+    {
+        _head.store(0, std::memory_order_relaxed);
+        _tail.store(0, std::memory_order_relaxed);
+        _dest = _start;
+        _erased = _start;
+        _busy = false;
+        _stats = {};
+    }
+
+    /**
+     * @brief producer side, safe from an ISR
+     *
+     * @return uint32_t bytes accepted, the rest is counted as dropped
+     */
+    uint32_t push(const uint8_t *buf, uint32_t size)
+    {
+        const uint32_t head = _head.load(std::memory_order_relaxed);
+        const uint32_t tail = _tail.load(std::memory_order_acquire);
+        const uint32_t space = ring_size - (head - tail);
+        const uint32_t take = (size < space) ? size : space;
+        const uint32_t pos = head & (ring_size - 1);
+        const uint32_t first = (take < ring_size - pos) ? take : (ring_size - pos);
+        memcpy(&_ring[pos], buf, first);
+        memcpy(&_ring[0], buf + first, take - first);
+        _head.store(head + take, std::memory_order_release);
+        _stats.dropped += size - take;
+        if (head + take - tail > _stats.max_occupancy)
+        {
+            _stats.max_occupancy = head + take - tail;
+        }
+        return take;
+    }
+
+    /**
+     * @brief consumer side, run one non blocking step
+     *
+     * @param flush also program a trailing partial page (end of capture)
+     * @return int 0 if successful or nothing to do, error otherwise
+     */
+    int service(bool flush = false)
+    {
+        if (_busy)
+        {
+            bool busy = true;
+            auto res = _flash.is_busy(busy);
+            if ((res != 0) || busy)
+            {
+                return res;
+            }
+            _busy = false;
+        }
+        const uint32_t tail = _tail.load(std::memory_order_relaxed);
+        const uint32_t level = _head.load(std::memory_order_acquire) - tail;
+        const bool page_ready = (level >= pg) || (flush && (level > 0));
+        const bool page_erased = _dest < _erased;
+        const bool pool_low = (_erased - _dest < _ahead) && (_erased < _end);
+        if (pool_low && (!page_ready || !page_erased || (level < ring_size / 2)))
+        {
+            return erase_next();
+        }
+        if (page_ready && page_erased)
+        {
+            return program_next(tail, (level < pg) ? level : pg);
+        }
+        return 0;
+    }
+
+    /**
+     * @brief program everything buffered, then wait for the chip
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int finish()
+    {
+        while (pending() > 0)
+        {
+            if (full())
+            {
+                return 1;
+            }
+            auto res = service(true);
+            if (res != 0)
+            {
+                return res;
+            }
+        }
+        _busy = false;
+        return _flash.wait_ready();
+    }
+
+    /**
+     * @brief bytes in the ring, not programmed yet
+     */
+    uint32_t pending() const
+    {
+        return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief true once the region is used up
+     */
+    bool full() const { return _dest >= _end; }
+
+    /**
+     * @brief flash offset of the next byte to program
+     */
+    uint32_t position() const { return _dest; }
+
+    const stats_t &stats() const { return _stats; }
+
+private:
+    static constexpr uint32_t pg = flash_t::get_pg();
+    static constexpr uint32_t sect = flash_t::get_sect_size();
+    static_assert(ring_size >= 2 * pg, "ring must hold two pages");
+
+    int erase_next()
+    {
+        auto res = _flash.erase_sector(reinterpret_cast<void *>(_erased), false);
+        if (res != 0)
+        {
+            return res;
+        }
+        _busy = true;
+        _erased += sect;
+        _stats.erases++;
+        return 0;
+    }
+
+    int program_next(uint32_t tail, uint32_t len)
+    {
+        /* a partial page keeps the next write inside the same page */
+        const uint32_t room = pg - (_dest % pg);
+        len = (len < room) ? len : room;
+        const uint32_t pos = tail & (ring_size - 1);
+        const uint32_t first = (len < ring_size - pos) ? len : (ring_size - pos);
+        const qspi_driver::segment_t segs[2] = {{&_ring[pos], first}, {&_ring[0], len - first}};
+        auto res = _flash.program_page(reinterpret_cast<void *>(_dest), segs, (first < len) ? 2 : 1, false);
+        if (res != 0)
+        {
+            return res;
+        }
+        /* the data went through the FIFO, the producer may reuse the space */
+        _tail.store(tail + len, std::memory_order_release);
+        _busy = true;
+        _dest += len;
+        /* the 32 bit stamps wrap after ~9s at 480MHz, the steps between two drains are short */
+        const uint32_t now = cycles::now();
+        if (_stats.bytes != 0)
+        {
+            _stats.cycles += now - _stamp;
+        }
+        _stamp = now;
+        _stats.bytes += len;
+        return 0;
+    }
+
+    flash_t &_flash;
+    const uint32_t _start;
+    const uint32_t _end;
+    const uint32_t _ahead;
+    uint32_t _dest;   // next flash offset to program
+    uint32_t _erased; // flash is erased up to this offset
+    bool _busy;       // program/erase started, BUSY not seen clear yet
+    uint32_t _stamp;  // cycles::now() of the last page program
+    stats_t _stats;
+    std::atomic<uint32_t> _head; // written by push()
+    std::atomic<uint32_t> _tail; // written by service()
+    uint8_t _ring[ring_size];
+};
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef SECTOR_RMW_HPP
+#define SECTOR_RMW_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include "stm32h7xx.h"
+#include "QspiFlash.hpp"
+
+/**
+ * @brief Read-modify-write of arbitrary ranges inside programmed sectors
+ *
+ * Each touched sector is copied through the memory mapped window into a
+ * staging buffer and the new bytes are merged. If the change only clears bits
+ * the changed pages are programmed over the old content. Otherwise only the
+ * 4KB units needing a 0 -> 1 transition are erased (the whole sector with one
+ * 64KB erase when all of them do) and their pages that are not all 0xFF are
+ * programmed again from the staging buffer.
+ *
+ * The staging buffer is reserved in AXI SRAM (.axisram, not initialized).
+ * The flash is expected in indirect mode and is left in indirect mode.
+ */
+template <QspiFlash flash_t>
+class sector_rmw
+{
+public:
+    sector_rmw(flash_t &flash) : _flash(flash) {}
+
+    /**
+     * @brief write a range, erasing what has to be erased
+     *
+     * @param dest flash offset
+     * @param size number of bytes
+     * @param src data
+     * @return int 0 if successful, error otherwise
+     */
+    int update(uint32_t dest, uint32_t size, const uint8_t *src)
+    {
+        while (size > 0)
+        {
+            const uint32_t base = dest - (dest % sect);
+            uint32_t chunk = sect - (dest - base);
+            if (chunk > size)
+            {
+                chunk = size;
+            }
+            auto res = update_sector(base, dest - base, chunk, src);
+            if (res != 0)
+            {
+                return res;
+            }
+            dest += chunk;
+            src += chunk;
+            size -= chunk;
+        }
+        return 0;
+    }
+
+    uint32_t subsector_erases() const { return _subsector_erases; }
+    uint32_t sector_erases() const { return _sector_erases; }
+    uint32_t page_programs() const { return _page_programs; }
+
+private:
+    static constexpr uint32_t sect = flash_t::get_sect_size();
+    static constexpr uint32_t unit = flash_t::get_subsect_size();
+    static constexpr uint32_t pg = flash_t::get_pg();
+    static constexpr uint32_t units = sect / unit;
+    static_assert(units <= 32, "erase unit mask is 32 bits");
+
+    int update_sector(uint32_t base, uint32_t off, uint32_t size, const uint8_t *src)
+    {
+        auto res = load(base);
+        if (res != 0)
+        {
+            return res;
+        }
+        /* units needing an erase, units with any change */
+        uint32_t erase_mask = 0;
+        uint32_t dirty_mask = 0;
+        for (uint32_t i = 0; i < size; i++)
+        {
+            const uint8_t old = _stage[off + i];
+            const uint32_t bit = 1UL << ((off + i) / unit);
+            if (old != src[i])
+            {
+                dirty_mask |= bit;
+                if ((old & src[i]) != src[i])
+                {
+                    erase_mask |= bit;
+                }
+            }
+        }
+        if (dirty_mask == 0)
+        {
+            return 0;
+        }
+        memcpy(&_stage[off], src, size);
+
+        if (erase_mask == ((units == 32) ? 0xFFFFFFFFUL : ((1UL << units) - 1)))
+        {
+            res = _flash.erase_sector(reinterpret_cast<void *>(base));
+            _sector_erases++;
+        }
+        else
+        {
+            for (uint32_t u = 0; (u < units) && (res == 0); u++)
+            {
+                if (erase_mask & (1UL << u))
+                {
+                    res = _flash.erase_subsector(reinterpret_cast<void *>(base + u * unit));
+                    _subsector_erases++;
+                }
+            }
+        }
+        if (res != 0)
+        {
+            return res;
+        }
+
+        for (uint32_t p = 0; p < sect; p += pg)
+        {
+            const uint32_t bit = 1UL << (p / unit);
+            if ((dirty_mask & bit) == 0)
+            {
+                continue;
+            }
+            /* erased units get all their data back, the others only the changed range */
+            uint32_t lo = p;
+            uint32_t hi = p + pg;
+            if ((erase_mask & bit) == 0)
+            {
+                lo = (off > lo) ? off : lo;
+                hi = (off + size < hi) ? (off + size) : hi;
+                if (lo >= hi)
+                {
+                    continue;
+                }
+            }
+            if (is_erased(lo, hi))
+            {
+                continue;
+            }
+            res = _flash.program_page(reinterpret_cast<void *>(base + lo), hi - lo, &_stage[lo]);
+            if (res != 0)
+            {
+                return res;
+            }
+            _page_programs++;
+        }
+        return 0;
+    }
+
+    bool is_erased(uint32_t lo, uint32_t hi) const
+    {
+        for (uint32_t i = lo; i < hi; i++)
+        {
+            if (_stage[i] != 0xFF)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief copy a sector into the staging buffer through the mapped window
+     */
+    int load(uint32_t base)
+    {
+        auto res = _flash.ensure_mapped();
+        if (res != 0)
+        {
+            return res;
+        }
+        memcpy(_stage.data(), reinterpret_cast<const uint8_t *>(QSPI_BASE + base), sect);
+        return _flash.ensure_indirect();
+    }
+
+    flash_t &_flash;
+    uint32_t _subsector_erases = 0;
+    uint32_t _sector_erases = 0;
+    uint32_t _page_programs = 0;
+    alignas(32) inline static std::array<uint8_t, sect> _stage __attribute__((section(".axisram")));
+};
+
+#endif
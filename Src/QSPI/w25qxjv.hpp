@@ -2,15 +2,91 @@
 #define W25Q64JV_HPP
 
 #include "QspiFlash.hpp"
+#include "poll_scheduler.hpp"
 #include <array>
 
-template <uint32_t flash_sz>
-class w25qxjv : public QspiFlash
+/**
+ * @brief Part description shared by the W25Q..JV family, times in microseconds
+ */
+struct w25qxjv_traits
+{
+    static constexpr uint32_t pg_size = 0x100;
+    static constexpr uint32_t sector_size = 0x00010000;
+    static constexpr uint32_t subsector_size = 0x00001000;
+    static constexpr uint32_t clk = 120000000UL;
+    /* read mode: Fast Read Quad I/O, continuous read disabled by the alternate byte */
+    static constexpr uint8_t read_dummy_cycles = 4;
+    static constexpr uint8_t alternate_byte = 0xf0;
+    /* M5-4 = 10: the chip stays in Fast Read Quad I/O, the next read starts at the address */
+    static constexpr uint8_t continuous_byte = 0x20;
+    /* typical / maximum operation times */
+    static constexpr uint32_t t_pp_typ = 400;
+    static constexpr uint32_t t_pp_max = 3000;
+    static constexpr uint32_t t_se_typ = 45000;
+    static constexpr uint32_t t_se_max = 400000;
+    static constexpr uint32_t t_be_typ = 150000;
+    static constexpr uint32_t t_be_max = 2000000;
+    static constexpr uint32_t t_w_typ = 10000;
+    static constexpr uint32_t t_w_max = 15000;
+    static constexpr uint32_t t_rst = 30;
+    /* entering / leaving deep power-down */
+    static constexpr uint32_t t_dp = 3;
+    static constexpr uint32_t t_res1 = 3;
+    enum cmd : uint8_t
+    {
+        write_enable = 0x06,
+        read_status_reg = 0x05,
+        write_vol_cfg_reg = 0x31,
+        sector_erase = 0xd8,
+        subsector_erase = 0x20,
+        chip_erase = 0xc7,
+        quad_in_fast_prog = 0x32,
+        read_conf_reg = 0x35,
+        quad_out_fast_read = 0xeb,
+        reset_enable = 0x66,
+        reset_execute = 0x99,
+        power_down = 0xb9,
+        release_power_down = 0xab,
+        mode_bit_reset = 0xff,
+    };
+};
+
+struct w25q64jv_traits : w25qxjv_traits
+{
+    static constexpr uint32_t size = 0x800000;
+    static constexpr uint32_t t_ce_typ = 20000000;
+    static constexpr uint32_t t_ce_max = 100000000;
+};
+
+struct w25q32jv_traits : w25qxjv_traits
+{
+    static constexpr uint32_t size = 0x400000;
+    static constexpr uint32_t t_ce_typ = 10000000;
+    static constexpr uint32_t t_ce_max = 50000000;
+};
+
+struct w25q16jv_traits : w25qxjv_traits
+{
+    static constexpr uint32_t size = 0x200000;
+    static constexpr uint32_t t_ce_typ = 5000000;
+    static constexpr uint32_t t_ce_max = 25000000;
+};
+
+template <typename traits>
+class w25qxjv
 {
 public:
-    w25qxjv(qspi_driver &drv) : QspiFlash(drv) {}
+    using traits_t = traits;
+    using scheduler = poll_scheduler<traits>;
+    w25qxjv(qspi_driver &drv) : _drv(drv) {}
+    /**
+     * @brief reset the chip and enable quad I/O, the peripheral must be in indirect mode
+     *
+     * @return int 0 if successful, error otherwise
+     */
     int init()
     {
+        _mapped = false;
         auto res = restart();
         if (res != 0)
         {
@@ -19,32 +95,98 @@ public:
         /* Enable Quad SPI for the chip */
         return enable_qio();
     }
-    int program_page(void *dest, const uint32_t size, void *src)
+    /**
+     * @brief program up to one page
+     *
+     * @param dest flash address
+     * @param size number of bytes, must not cross a page boundary
+     * @param src data to program
+     * @param wait false to return as soon as the command is sent, see wait_ready()
+     * @return int 0 if successful, error otherwise
+     */
+    int program_page(void *dest, const uint32_t size, void *src, bool wait = true)
+    {
+        const qspi_driver::segment_t seg = {static_cast<const uint8_t *>(src), size};
+        return program_page(dest, &seg, 1, wait);
+    }
+    /**
+     * @brief program up to one page gathered from several buffers
+     *
+     * The segments are streamed back to back into a single page program, a
+     * record made of header and payload needs no staging copy.
+     *
+     * @param dest flash address
+     * @param segs data segments, their total must not cross a page boundary
+     * @param count number of segments
+     * @param wait false to return as soon as the command is sent, see wait_ready()
+     * @return int 0 if successful, error otherwise
+     */
+    int program_page(void *dest, const qspi_driver::segment_t *segs, uint32_t count, bool wait = true)
     {
+        int res = mark_stale();
+        if (res != qspi_driver::QSPI_OK)
+        {
+            return res;
+        }
         uint32_t dst_addr = reinterpret_cast<uint32_t>(dest);
-        const qspi_driver::transact_t prg_cmd = {
-            {
-                {qspi_driver::QSPI_1_LINE, quad_in_fast_prog},           // instruction
-                {qspi_driver::QSPI_1_LINE, qspi_driver::L24B, dst_addr}, // address
-                {qspi_driver::QSPI_None, qspi_driver::L24B, 0},          // alternate bytes
-                {qspi_driver::SDR, qspi_driver::ANALOG_DELAY},           // ddr mode
-                0,                                                       // dummy cycle
-                false                                                    // sio0
-            },
-            {qspi_driver::QSPI_4_LINE, static_cast<uint8_t *>(src), size},
+        const qspi_driver::header_t prg_cmd = {
+            {qspi_driver::QSPI_1_LINE, quad_in_fast_prog},           // instruction
+            {qspi_driver::QSPI_1_LINE, qspi_driver::L24B, dst_addr}, // address
+            {qspi_driver::QSPI_None, qspi_driver::L24B, 0},          // alternate bytes
+            {qspi_driver::SDR, qspi_driver::ANALOG_DELAY},           // ddr mode
+            0,                                                       // dummy cycle
+            false                                                    // sio0
         };
         // Enable write
-        int res = wen();
+        res = wen();
         if (res != qspi_driver::QSPI_OK)
         {
             return res;
         }
-        res = _drv.write(prg_cmd);
+        res = _drv.write(prg_cmd, qspi_driver::QSPI_4_LINE, segs, count);
         if (res != qspi_driver::QSPI_OK)
         {
             return res;
         }
-        return poll_busy();
+        uint32_t total = 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            total += segs[i].size;
+        }
+        invalidate(dst_addr, total);
+        scheduler::start(scheduler::PAGE_PROGRAM);
+        return wait ? poll_busy() : 0;
+    }
+    /**
+     * @brief program an arbitrary long buffer, split into page programs
+     *
+     * @param dest flash address
+     * @param size number of bytes
+     * @param src data to program
+     * @param wait false to return without waiting for the last page, see wait_ready()
+     * @return int 0 if successful, error otherwise
+     */
+    int program(void *dest, uint32_t size, void *src, bool wait = true)
+    {
+        uint32_t dst_addr = reinterpret_cast<uint32_t>(dest);
+        uint8_t *src_ptr = static_cast<uint8_t *>(src);
+        while (size > 0)
+        {
+            /* a page program wraps around inside the page, never cross the boundary */
+            uint32_t chunk = pg_size - (dst_addr % pg_size);
+            if (chunk > size)
+            {
+                chunk = size;
+            }
+            int res = program_page(reinterpret_cast<void *>(dst_addr), chunk, src_ptr, wait || (chunk != size));
+            if (res != 0)
+            {
+                return res;
+            }
+            dst_addr += chunk;
+            src_ptr += chunk;
+            size -= chunk;
+        }
         return 0;
     }
     uint32_t verify(void *dest, const uint32_t size, void *src)
@@ -55,12 +197,12 @@ public:
         uint32_t sz = 0;
         while (sz < size)
         {
-            std::size_t read_sz = size;
-            if (size > get_pg())
+            std::size_t read_sz = size - sz;
+            if (read_sz > get_pg())
             {
                 read_sz = get_pg();
             }
-            int res = read(dest, read_sz, buffer.data());
+            int res = read(static_cast<uint8_t *>(dest) + sz, read_sz, buffer.data());
             if (res != qspi_driver::QSPI_OK)
             {
                 return 0;
@@ -83,12 +225,12 @@ public:
         uint32_t sz = 0;
         while (sz < size)
         {
-            std::size_t read_sz = size;
-            if (size > get_pg())
+            std::size_t read_sz = size - sz;
+            if (read_sz > get_pg())
             {
                 read_sz = get_pg();
             }
-            int res = read(dest, read_sz, buffer.data());
+            int res = read(static_cast<uint8_t *>(dest) + sz, read_sz, buffer.data());
             if (res != qspi_driver::QSPI_OK)
             {
                 return res;
@@ -105,38 +247,52 @@ public:
         return 0;
     }
 
-    int erase_sector(void *adr)
+    /**
+     * @brief erase one 64KB sector
+     *
+     * @param adr flash address inside the sector
+     * @param wait false to return as soon as the command is sent, see wait_ready()
+     * @return int 0 if successful, error otherwise
+     */
+    int erase_sector(void *adr, bool wait = true)
     {
-        // Enable write
-        int res = wen();
-        if (res != qspi_driver::QSPI_OK)
-        {
-            return res;
-        }
-        uint32_t addr = reinterpret_cast<uint32_t>(adr);
-        const qspi_driver::transact_t erase_cmd = {
-            {
-                {qspi_driver::QSPI_1_LINE, sector_erase},            // instruction
-                {qspi_driver::QSPI_1_LINE, qspi_driver::L24B, addr}, // address
-                {qspi_driver::QSPI_None, qspi_driver::L24B, 0},      // alternate bytes
-                {qspi_driver::SDR, qspi_driver::ANALOG_DELAY},       // ddr mode
-                0,                                                   // dummy cycle
-                false                                                // sio0
-            },
-            {qspi_driver::QSPI_None, nullptr, 0},
-        };
-        res = _drv.write(erase_cmd);
-        if (res != qspi_driver::QSPI_OK)
-        {
-            return res;
-        }
-        return poll_busy();
+        return erase_block(sector_erase, adr, wait);
+    }
+
+    /**
+     * @brief erase one 4KB sub-sector
+     *
+     * @param adr flash address inside the sub-sector
+     * @param wait false to return as soon as the command is sent, see wait_ready()
+     * @return int 0 if successful, error otherwise
+     */
+    int erase_subsector(void *adr, bool wait = true)
+    {
+        return erase_block(subsector_erase, adr, wait);
+    }
+
+    /**
+     * @brief erase with the opcode matching the erase unit
+     *
+     * @param adr flash address inside the erase unit
+     * @param size erase unit, get_subsect_size() or get_sect_size()
+     * @param wait false to return as soon as the command is sent, see wait_ready()
+     * @return int 0 if successful, error otherwise
+     */
+    int erase(void *adr, uint32_t size, bool wait = true)
+    {
+        return (size < sector_size) ? erase_subsector(adr, wait) : erase_sector(adr, wait);
     }
 
     int erase_chip()
     {
+        int res = mark_stale();
+        if (res != qspi_driver::QSPI_OK)
+        {
+            return res;
+        }
         // Enable write
-        int res = wen();
+        res = wen();
         if (res != qspi_driver::QSPI_OK)
         {
             return res;
@@ -157,6 +313,13 @@ public:
         {
             return res;
         }
+        SCB_InvalidateDCache_by_Addr(reinterpret_cast<void *>(QSPI_BASE), static_cast<int32_t>(size));
+        SCB_InvalidateICache();
+        if (_change_hook != nullptr)
+        {
+            _change_hook(0, size);
+        }
+        scheduler::start(scheduler::CHIP_ERASE);
         return poll_busy();
     }
     int read(void *dest, uint32_t size, void *buff)
@@ -169,7 +332,7 @@ public:
                 {qspi_driver::QSPI_4_LINE, qspi_driver::L24B, dst_addr},      // address
                 {qspi_driver::QSPI_4_LINE, qspi_driver::L8B, alternate_byte}, // alternate bytes
                 {qspi_driver::SDR, qspi_driver::ANALOG_DELAY},                // ddr mode
-                4,                                                            // dummy cycle
+                traits::read_dummy_cycles,                                    // dummy cycle
                 false                                                         // sio0
             },
             {qspi_driver::QSPI_4_LINE, static_cast<uint8_t *>(buff), size},
@@ -181,30 +344,278 @@ public:
         }
         return 0;
     }
-    int mmap()
+    int abort()
+    {
+        if (_mapped)
+        {
+            /* Quirks: Trigger Read access, otherwise abort will stuck */
+            (void)*reinterpret_cast<volatile const uint32_t *>(QSPI_BASE);
+            _mapped = false;
+        }
+        auto res = _drv.abort();
+        if ((res != qspi_driver::QSPI_OK) || !_continuous)
+        {
+            return res;
+        }
+        _continuous = false;
+        return exit_continuous();
+    }
+    int mmap() { return mmap(false, 0); }
+    /**
+     * @brief memory mapped mode with explicit read options
+     *
+     * @param continuous continuous read: the instruction is sent once (SIOO) and
+     *                   the chip keeps the read mode, abort() takes it out again
+     * @param timeout QUADSPI clocks without access before nCS is released
+     *                (LPTR), 0 keeps nCS low and the prefetch running (TCEN off)
+     * @return int 0 if successful, error otherwise
+     */
+    int mmap(bool continuous, uint16_t timeout)
     {
         const qspi_driver::memmap_t memmap_cmd = {
             {
-                {qspi_driver::QSPI_1_LINE, quad_out_fast_read},               // instruction
-                {qspi_driver::QSPI_4_LINE, qspi_driver::L24B, 0},             // address
-                {qspi_driver::QSPI_4_LINE, qspi_driver::L8B, alternate_byte}, // alternate bytes
-                {qspi_driver::SDR, qspi_driver::ANALOG_DELAY},                // ddr mode
-                4,                                                            // dummy cycle
-                false                                                         // sio0
+                {qspi_driver::QSPI_1_LINE, quad_out_fast_read},   // instruction
+                {qspi_driver::QSPI_4_LINE, qspi_driver::L24B, 0}, // address
+                {qspi_driver::QSPI_4_LINE, qspi_driver::L8B,
+                 continuous ? continuous_byte : alternate_byte},  // alternate bytes
+                {qspi_driver::SDR, qspi_driver::ANALOG_DELAY},    // ddr mode
+                traits::read_dummy_cycles,                        // dummy cycle
+                continuous                                        // sio0
             },
-            {qspi_driver::QSPI_4_LINE, 0, false},
+            {qspi_driver::QSPI_4_LINE, timeout, timeout != 0},
         };
-        return _drv.mmap(memmap_cmd);
+        _continuous = continuous;
+        auto res = _drv.mmap(memmap_cmd);
+        _mapped = (res == qspi_driver::QSPI_OK);
+        return res;
+    }
+    /**
+     * @brief memory mapped mode unless already in it
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int ensure_mapped() { return _mapped ? 0 : mmap(); }
+    /**
+     * @brief indirect mode (program, erase, indirect reads) unless already in it
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int ensure_indirect() { return _mapped ? abort() : 0; }
+    /**
+     * @brief true while the window is mapped, set by mmap(), cleared by abort() and init()
+     */
+    static bool is_mapped() { return _mapped; }
+    /**
+     * @brief wait for a program or erase started with wait = false
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int wait_ready() { return poll_busy(); }
+    /**
+     * @brief read the QE bit of status register 2
+     *
+     * @param enabled set if quad I/O is enabled in the chip
+     * @return int 0 if successful, error otherwise
+     */
+    int quad_enabled(bool &enabled)
+    {
+        uint8_t reg = 0;
+        auto res = read_conf(reg);
+        if (res != qspi_driver::QSPI_OK)
+        {
+            return res;
+        }
+        enabled = (reg & 0x2) != 0;
+        return 0;
+    }
+    /**
+     * @brief read BUSY once without waiting
+     *
+     * @param busy set if a program or erase is still running
+     * @return int 0 if successful, error otherwise
+     */
+    int is_busy(bool &busy)
+    {
+        uint8_t reg = 0;
+        qspi_driver::transact_t get_status = {
+            {
+                {qspi_driver::QSPI_1_LINE, read_status_reg},    // instruction
+                {qspi_driver::QSPI_None, qspi_driver::L24B, 0}, // address
+                {qspi_driver::QSPI_None, qspi_driver::L24B, 0}, // alternate bytes
+                {qspi_driver::SDR, qspi_driver::ANALOG_DELAY},  // ddr mode
+                0,                                              // dummy cycle
+                false                                           // sio0
+            },
+            {qspi_driver::QSPI_1_LINE, &reg, sizeof(reg)},
+        };
+        auto res = _drv.read(get_status);
+        if (res != qspi_driver::QSPI_OK)
+        {
+            return res;
+        }
+        busy = (reg & 0x01) != 0;
+        if (!busy)
+        {
+            /* seen idle at an arbitrary time, nothing to learn */
+            scheduler::drop();
+        }
+        return 0;
+    }
+    /**
+     * @brief enter deep power-down, only release() is accepted afterwards
+     *
+     * The chip must be idle and the driver in indirect mode.
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int sleep()
+    {
+        auto res = command(power_down);
+        if (res != qspi_driver::QSPI_OK)
+        {
+            return res;
+        }
+        scheduler::delay_us(traits::t_dp);
+        return 0;
+    }
+    /**
+     * @brief leave deep power-down, status and configuration are kept (no re-init)
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int release()
+    {
+        auto res = command(release_power_down);
+        if (res != qspi_driver::QSPI_OK)
+        {
+            return res;
+        }
+        scheduler::delay_us(traits::t_res1);
+        return 0;
     }
     static constexpr uint32_t get_size() { return size; }
     static constexpr uint32_t get_pg() { return pg_size; }
     static constexpr uint32_t get_sect_size() { return sector_size; }
+    static constexpr uint32_t get_subsect_size() { return subsector_size; }
     static constexpr uint32_t get_max_clk() { return clk; }
 
+    /**
+     * @brief flash range executed from the window, the whole flash by default
+     *
+     * Program and erase drop the cached window lines of the range they change,
+     * the I-cache lines only where the range overlaps the code.
+     */
+    static void set_code_range(uint32_t offset, uint32_t size)
+    {
+        _code_start = offset;
+        _code_end = offset + size;
+    }
+
+    /**
+     * @brief called with every range a program or erase changes, when the command is sent
+     *
+     * For copies of the flash kept outside the cache, nullptr removes it.
+     */
+    static void set_change_hook(void (*hook)(uint32_t offset, uint32_t size)) { _change_hook = hook; }
+
+    static constexpr uint32_t no_stale_word = 0xFFFFFFFF;
+    /**
+     * @brief word programmed to 0 before the first program or erase
+     *
+     * Marks a record of the flash content kept in the flash itself (the loader
+     * manifest header) as stale once something else changes the flash, it is
+     * cleared once and then forgotten. no_stale_word turns it off.
+     */
+    static void set_stale_word(uint32_t offset) { _stale_word = offset; }
+
 private:
-    int enable_qio()
+    /**
+     * @brief invalidate the D-cache (and I-cache, for code) lines of a changed range
+     *
+     * The window is not refilled while the driver is in indirect mode, doing
+     * it when the command is sent also covers program/erase without waiting.
+     */
+    static void invalidate(uint32_t adr, uint32_t len)
+    {
+        void *win = reinterpret_cast<void *>(QSPI_BASE + adr);
+        SCB_InvalidateDCache_by_Addr(win, static_cast<int32_t>(len));
+        if ((adr < _code_end) && (adr + len > _code_start))
+        {
+            SCB_InvalidateICache_by_Addr(win, static_cast<int32_t>(len));
+        }
+        if (_change_hook != nullptr)
+        {
+            _change_hook(adr, len);
+        }
+    }
+
+
+    int mark_stale()
+    {
+        if (_stale_word == no_stale_word)
+        {
+            return 0;
+        }
+        void *word = reinterpret_cast<void *>(_stale_word);
+        uint32_t zero = 0;
+        _stale_word = no_stale_word;
+        return program_page(word, sizeof(zero), &zero);
+    }
+
+    int command(uint8_t instr)
+    {
+        const qspi_driver::transact_t cmd = {
+            {
+                {qspi_driver::QSPI_1_LINE, instr},              // instruction
+                {qspi_driver::QSPI_None, qspi_driver::L24B, 0}, // address
+                {qspi_driver::QSPI_None, qspi_driver::L24B, 0}, // alternate bytes
+                {qspi_driver::SDR, qspi_driver::ANALOG_DELAY},  // ddr mode
+                0,                                              // dummy cycle
+                false                                           // sio0
+            },
+            {qspi_driver::QSPI_None, nullptr, 0},
+        };
+        return _drv.write(cmd);
+    }
+
+    int erase_block(uint8_t cmd, void *adr, bool wait)
+    {
+        int res = mark_stale();
+        if (res != qspi_driver::QSPI_OK)
+        {
+            return res;
+        }
+        // Enable write
+        res = wen();
+        if (res != qspi_driver::QSPI_OK)
+        {
+            return res;
+        }
+        uint32_t addr = reinterpret_cast<uint32_t>(adr);
+        const qspi_driver::transact_t erase_cmd = {
+            {
+                {qspi_driver::QSPI_1_LINE, cmd},                     // instruction
+                {qspi_driver::QSPI_1_LINE, qspi_driver::L24B, addr}, // address
+                {qspi_driver::QSPI_None, qspi_driver::L24B, 0},      // alternate bytes
+                {qspi_driver::SDR, qspi_driver::ANALOG_DELAY},       // ddr mode
+                0,                                                   // dummy cycle
+                false                                                // sio0
+            },
+            {qspi_driver::QSPI_None, nullptr, 0},
+        };
+        res = _drv.write(erase_cmd);
+        if (res != qspi_driver::QSPI_OK)
+        {
+            return res;
+        }
+        const uint32_t unit = (cmd == sector_erase) ? sector_size : subsector_size;
+        invalidate(addr & ~(unit - 1), unit);
+        scheduler::start((cmd == sector_erase) ? scheduler::SECTOR_ERASE : scheduler::SUBSECTOR_ERASE);
+        return wait ? poll_busy() : 0;
+    }
+
+    int read_conf(uint8_t &reg)
     {
-        uint8_t reg = 0;
         qspi_driver::transact_t get_status = {
             {
                 {qspi_driver::QSPI_1_LINE, read_conf_reg},      // instruction
@@ -216,7 +627,13 @@ private:
             },
             {qspi_driver::QSPI_1_LINE, &reg, sizeof(reg)},
         };
-        auto res = _drv.read(get_status);
+        return _drv.read(get_status);
+    }
+
+    int enable_qio()
+    {
+        uint8_t reg = 0;
+        auto res = read_conf(reg);
         if (res != qspi_driver::QSPI_OK)
         {
             return res;
@@ -238,7 +655,14 @@ private:
                  false},
                 {qspi_driver::QSPI_1_LINE, &reg, 1},
             };
-            return _drv.write(write_val);
+            res = _drv.write(write_val);
+            if (res != qspi_driver::QSPI_OK)
+            {
+                return res;
+            }
+            /* QE reads back once the status register write completed */
+            scheduler::start(scheduler::STATUS_WRITE);
+            return poll_busy();
         }
         return 0;
     }
@@ -278,6 +702,7 @@ private:
         {
             return res;
         }
+        scheduler::start(scheduler::RESET);
         return poll_busy();
     }
 
@@ -299,6 +724,7 @@ private:
         {
             return res;
         }
+        scheduler::start(scheduler::WEL);
         /* Poll the status bit 2 for enabling the write */
         const qspi_driver::polling_t poll_trans = {
             {{qspi_driver::QSPI_1_LINE, read_status_reg},    // instruction
@@ -312,12 +738,14 @@ private:
                 0x02,                    // match res
                 0x02,                    // mask
                 0x01,                    // byte size
-                0x10,                    // interval
+                scheduler::prepare(),    // interval
                 qspi_driver::AND,        // match mode
                 true,                    // auto stop
                 qspi_driver::QSPI_1_LINE // 1 Line
             }};
-        return _drv.poll(poll_trans);
+        res = _drv.poll(poll_trans);
+        scheduler::complete();
+        return res;
     }
 
     int poll_busy()
@@ -333,47 +761,73 @@ private:
              0x00,             // match res
              0x01,             // mask
              0x01,             // byte size
-             0x10,             // interval
+             scheduler::prepare(), // interval
              qspi_driver::AND, // match mode
              true,             // auto stop
              qspi_driver::QSPI_1_LINE},
         };
-        return _drv.poll(poll_trans);
+        auto res = _drv.poll(poll_trans);
+        scheduler::complete();
+        return res;
     }
 
-    static constexpr uint32_t size = flash_sz;
-    static constexpr uint32_t pg_size = 0x100;
-    static constexpr uint32_t sector_size = 0x00010000;
-    static constexpr uint8_t alternate_byte = 0xf0;
-    static constexpr uint32_t clk = 120000000UL;
-    enum cmd
+    /**
+     * @brief leave continuous read mode
+     *
+     * The chip takes the next clocks as address and mode bits, eight clocks
+     * with all lines high give M7-0 = FF and end the mode.
+     */
+    int exit_continuous()
     {
-        write_enable = 0x06,
-        read_status_reg = 0x05,
-        write_vol_cfg_reg = 0x31,
-        sector_erase = 0xd8,
-        chip_erase = 0xc7,
-        quad_in_fast_prog = 0x32,
-        read_conf_reg = 0x35,
-        quad_out_fast_read = 0xeb,
-        reset_enable = 0x66,
-        reset_execute = 0x99,
-    };
-};
-
-class w25q64jv final : public w25qxjv<0x800000> {
-public:
-    w25q64jv(qspi_driver &drv) : w25qxjv<0x800000>(drv) {}
-};
+        const qspi_driver::transact_t reset = {
+            {
+                {qspi_driver::QSPI_4_LINE, mode_bit_reset},                // instruction
+                {qspi_driver::QSPI_4_LINE, qspi_driver::L24B, 0x00FFFFFF}, // address
+                {qspi_driver::QSPI_None, qspi_driver::L24B, 0},            // alternate bytes
+                {qspi_driver::SDR, qspi_driver::ANALOG_DELAY},             // ddr mode
+                0,                                                         // dummy cycle
+                false                                                      // sio0
+            },
+            {qspi_driver::QSPI_None, nullptr, 0},
+        };
+        return _drv.write(reset);
+    }
 
-class w25q32jv final : public w25qxjv<0x400000> {
-public:
-    w25q32jv(qspi_driver &drv) : w25qxjv<0x400000>(drv) {}
+    qspi_driver &_drv;
+    bool _continuous = false;
+    static constexpr uint32_t size = traits::size;
+    static constexpr uint32_t pg_size = traits::pg_size;
+    static constexpr uint32_t sector_size = traits::sector_size;
+    static constexpr uint32_t subsector_size = traits::subsector_size;
+    static constexpr uint8_t alternate_byte = traits::alternate_byte;
+    static constexpr uint8_t continuous_byte = traits::continuous_byte;
+    static constexpr uint32_t clk = traits::clk;
+    using cmd = typename traits::cmd;
+    static constexpr cmd write_enable = traits::write_enable;
+    static constexpr cmd read_status_reg = traits::read_status_reg;
+    static constexpr cmd write_vol_cfg_reg = traits::write_vol_cfg_reg;
+    static constexpr cmd sector_erase = traits::sector_erase;
+    static constexpr cmd subsector_erase = traits::subsector_erase;
+    static constexpr cmd chip_erase = traits::chip_erase;
+    static constexpr cmd quad_in_fast_prog = traits::quad_in_fast_prog;
+    static constexpr cmd read_conf_reg = traits::read_conf_reg;
+    static constexpr cmd quad_out_fast_read = traits::quad_out_fast_read;
+    static constexpr cmd reset_enable = traits::reset_enable;
+    static constexpr cmd reset_execute = traits::reset_execute;
+    static constexpr cmd power_down = traits::power_down;
+    static constexpr cmd release_power_down = traits::release_power_down;
+    static constexpr cmd mode_bit_reset = traits::mode_bit_reset;
+    inline static uint32_t _code_start = 0;
+    inline static uint32_t _code_end = traits::size;
+    inline static void (*_change_hook)(uint32_t, uint32_t) = nullptr;
+    inline static uint32_t _stale_word = no_stale_word;
+    /* mode of the peripheral, shared by every driver instance (the loaders build one per call) */
+    inline static bool _mapped = false;
 };
 
-class w25q16jv final : public w25qxjv<0x200000> {
-public:
-    w25q16jv(qspi_driver &drv) : w25qxjv<0x200000>(drv) {}
-};
+using w25q64jv = w25qxjv<w25q64jv_traits>;
+using w25q32jv = w25qxjv<w25q32jv_traits>;
+using w25q16jv = w25qxjv<w25q16jv_traits>;
+static_assert(QspiFlash<w25q64jv> && QspiFlash<w25q32jv> && QspiFlash<w25q16jv>);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,230 @@
+#ifndef WRITE_COMBINER_HPP
+#define WRITE_COMBINER_HPP
+
+#include <stdint.h>
+#include <array>
+#include "QspiFlash.hpp"
+#include "poll_scheduler.hpp"
+
+/**
+ * @brief Collects small writes in a page buffer before programming them
+ *
+ * Writes to the page being collected are merged in RAM (with NOR semantics,
+ * bits are only cleared) and the page is programmed once: when a write leaves
+ * the page, when the page is full, on flush() or when poll() sees the buffer
+ * older than the timeout. A write to another page flushes the current one
+ * first. The program is left running, the next flash access waits for it.
+ *
+ * read() returns the flash content combined with the bytes still buffered.
+ * Flush before erasing a range that may be buffered, see discard().
+ */
+template <QspiFlash flash_t>
+class write_combiner
+{
+public:
+    /**
+     * @param flash flash driver, in indirect mode while the combiner is used
+     * @param timeout_cycles CPU cycles a buffered byte may wait, 0 disables the timeout
+     */
+    write_combiner(flash_t &flash, uint32_t timeout_cycles = 0) : _flash(flash), _timeout(timeout_cycles) {}
+
+    /**
+     * @brief buffer a write, programming the pages it completes or leaves
+     *
+     * @param dest flash address
+     * @param size number of bytes
+     * @param src data
+     * @return int 0 if successful, error otherwise
+     */
+    int write(uint32_t dest, uint32_t size, const uint8_t *src)
+    {
+        while (size > 0)
+        {
+            const uint32_t base = dest - (dest % pg);
+            const uint32_t off = dest - base;
+            uint32_t chunk = pg - off;
+            if (chunk > size)
+            {
+                chunk = size;
+            }
+            if (_dirty && (base != _base))
+            {
+                auto res = flush(false);
+                if (res != 0)
+                {
+                    return res;
+                }
+            }
+            if (!_dirty)
+            {
+                _buf.fill(0xFF);
+                _base = base;
+                _lo = off;
+                _hi = off;
+                _stamp = cycles::now();
+                _dirty = true;
+            }
+            for (uint32_t i = 0; i < chunk; i++)
+            {
+                _buf[off + i] &= src[i];
+            }
+            _lo = (off < _lo) ? off : _lo;
+            _hi = (off + chunk > _hi) ? (off + chunk) : _hi;
+            _merged += chunk;
+            dest += chunk;
+            src += chunk;
+            size -= chunk;
+            /* sequential appends complete the page here */
+            if (_hi == pg)
+            {
+                auto res = flush(false);
+                if (res != 0)
+                {
+                    return res;
+                }
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * @brief read flash content as it will be once the buffer is programmed
+     *
+     * @param src flash address
+     * @param size number of bytes
+     * @param dst destination buffer
+     * @return int 0 if successful, error otherwise
+     */
+    int read(uint32_t src, uint32_t size, uint8_t *dst)
+    {
+        auto res = settle();
+        if (res != 0)
+        {
+            return res;
+        }
+        res = _flash.read(reinterpret_cast<void *>(src), size, dst);
+        if ((res != 0) || !_dirty)
+        {
+            return res;
+        }
+        const uint32_t lo = _base + _lo;
+        const uint32_t hi = _base + _hi;
+        for (uint32_t adr = (src > lo) ? src : lo; (adr < hi) && (adr < src + size); adr++)
+        {
+            dst[adr - src] &= _buf[adr - _base];
+        }
+        return 0;
+    }
+
+    /**
+     * @brief program the buffered bytes now
+     *
+     * @param wait true to also wait for the page program
+     * @return int 0 if successful, error otherwise
+     */
+    int flush(bool wait = true)
+    {
+        auto res = settle();
+        if (res != 0)
+        {
+            return res;
+        }
+        if (_dirty)
+        {
+            _dirty = false;
+            res = _flash.program_page(reinterpret_cast<void *>(_base + _lo), _hi - _lo, &_buf[_lo], false);
+            if (res != 0)
+            {
+                return res;
+            }
+            _in_flight = true;
+            _programs++;
+        }
+        return wait ? settle() : 0;
+    }
+
+    /**
+     * @brief flush the buffer when it is older than the timeout, call periodically
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int poll()
+    {
+        if (_dirty && (_timeout != 0) && ((cycles::now() - _stamp) >= _timeout))
+        {
+            return flush(false);
+        }
+        return 0;
+    }
+
+    /**
+     * @brief drop buffered bytes in [adr, adr + size), e.g. before erasing them
+     *
+     * Buffered bytes outside the range stay buffered. A hole in the middle of
+     * the buffer is set to 0xFF, which programs nothing.
+     */
+    void discard(uint32_t adr, uint32_t size)
+    {
+        if (!_dirty || (adr >= _base + _hi) || (_base + _lo >= adr + size))
+        {
+            return;
+        }
+        const uint32_t lo = (adr > _base + _lo) ? (adr - _base) : _lo;
+        const uint32_t hi = (adr + size < _base + _hi) ? (adr + size - _base) : _hi;
+        for (uint32_t i = lo; i < hi; i++)
+        {
+            _buf[i] = 0xFF;
+        }
+        if (lo == _lo)
+        {
+            _lo = hi;
+        }
+        if (hi == _hi)
+        {
+            _hi = lo;
+        }
+        _dirty = (_lo < _hi);
+    }
+
+    /**
+     * @brief wait for the page program left running by a flush
+     *
+     * @return int 0 if successful, error otherwise
+     */
+    int settle()
+    {
+        if (!_in_flight)
+        {
+            return 0;
+        }
+        _in_flight = false;
+        return _flash.wait_ready();
+    }
+
+    /**
+     * @brief bytes accepted by write()
+     */
+    uint32_t merged() const { return _merged; }
+
+    /**
+     * @brief page programs issued
+     */
+    uint32_t programs() const { return _programs; }
+
+private:
+    static constexpr uint32_t pg = flash_t::get_pg();
+
+    flash_t &_flash;
+    uint32_t _timeout;
+    std::array<uint8_t, pg> _buf;
+    uint32_t _base = 0;   // flash address of the buffered page
+    uint32_t _lo = 0;     // first buffered byte in the page
+    uint32_t _hi = 0;     // end of the buffered bytes in the page
+    uint32_t _stamp = 0;  // cycles::now() of the first buffered write
+    uint32_t _merged = 0;
+    uint32_t _programs = 0;
+    bool _dirty = false;     // buffer holds bytes not programmed yet
+    bool _in_flight = false; // page program not waited for
+};
+
+#endif
@@ -4,16 +4,56 @@
  */
 #include "Dev_Inf.hpp"
 #include "Config.hpp"
+/**
+ * @brief number of runs of equally sized sectors in the device
+ */
+static constexpr uint32_t sector_runs()
+{
+    uint32_t runs = 0;
+    uint32_t current = 0;
+    for (uint32_t adr = 0; adr < device_size; adr += sector_size_at(adr))
+    {
+        runs += (sector_size_at(adr) != current) ? 1 : 0;
+        current = sector_size_at(adr);
+    }
+    return runs;
+}
+static_assert(sector_runs() + 1 <= SECTOR_NUM, "Sector runs and their terminator do not fit SECTOR_NUM");
+
+/**
+ * @brief build the storage description, one entry per run of equally sized sectors
+ *
+ * @return constexpr struct StorageInfo
+ */
+static constexpr struct StorageInfo make_storage_info()
+{
+    struct StorageInfo info = {};
+    const char name[] = FLASH_LDR_NAME;
+    static_assert(sizeof(name) <= sizeof(info.DeviceName), "Device name too long");
+    for (uint32_t i = 0; i < sizeof(name); i++)
+    {
+        info.DeviceName[i] = name[i];
+    }
+    info.DeviceType = SPI_FLASH;          // Device Type
+    info.DeviceStartAddress = QSPI_BASE;  // Device Start Address
+    info.DeviceSize = device_size;        // Device Size in Bytes
+    info.PageSize = pg_size;              // Programming Page Size
+    info.EraseValue = 0xFF;               // Initial Content of Erased Memory
+    // Sectors as {number of sectors, sector size} runs, terminated by {0, 0}
+    uint32_t entry = 0;
+    for (uint32_t adr = 0; adr < device_size; adr += sector_size_at(adr))
+    {
+        const uint32_t size = sector_size_at(adr);
+        if ((entry == 0) || (info.sectors[entry - 1].SectorSize != size))
+        {
+            info.sectors[entry++] = {0, size};
+        }
+        info.sectors[entry - 1].SectorNum++;
+    }
+    return info;
+}
+
 extern "C"
 {
-    struct StorageInfo const StorageInfo __attribute__((section("DevDscr"))) = {
-        FLASH_LDR_NAME, // Device Name + version number
-        SPI_FLASH,      // Device Type
-        QSPI_BASE,      // Device Start Address
-        flash_size,     // Device Size in Bytes
-        pg_size,        // Programming Page Size
-        0xFF,           // Initial Content of Erased Memory
-        // Specify Size and Address of Sectors (view example below)
-        (flash_size / sector_size), sector_size, // Sector Size
-        0x00000000, 0x00000000};
-};
\ No newline at end of file
+    constinit struct StorageInfo const StorageInfo __attribute__((section("DevDscr"))) = make_storage_info();
+};
@@ -1,10 +1,15 @@
 
 #include "Config.hpp"
 #include "watchdog.hpp"
-#include "Board.hpp"
+#include "Session.hpp"
+#include "Manifest.hpp"
+#include "lz4_stream.hpp"
 #define LOADER_OK 0x1
 #define LOADER_FAIL 0x0
 
+/* packed image being decoded by Write, see Tools/lz4pack.py */
+static lz4_stream<> unpacker;
+
 extern "C"
 {
     void SystemInit(void);
@@ -26,24 +31,27 @@ extern "C"
         SCB_EnableICache();
         SCB_EnableDCache();
         Board::rcc_config();
-        qspi_driver drv(QUADSPI);
-        FLASH_CLASS flash(drv);
-        drv.deinit();
-        Board::gpio_deinit();
-        Board::gpio_init();
-        drv.init(qspi_init);
-        int res = flash.init();
-        if (res != 0)
+        unpacker.reset();
+        flash_session session;
+        /* also fails when the last deferred Write of the previous operation did not complete */
+        if (session.begin() != 0)
         {
             return LOADER_FAIL;
         }
-        if (flash.mmap() != 0)
+        if (flash_manifest::enabled)
+        {
+            /* erases of the previous operation that got no data, then reload the manifest */
+            flash_manifest manifest(session);
+            if (manifest.commit() != 0)
+            {
+                return LOADER_FAIL;
+            }
+            manifest.drop();
+        }
+        if (session.mapped() != 0)
         {
             return LOADER_FAIL;
         }
-        /* Quirks: Trigger Read access, otherwise abort will stuck */
-        uint32_t a = *(uint32_t *)(QSPI_BASE);
-        a++;
         return LOADER_OK;
     }
 
@@ -57,49 +65,68 @@ extern "C"
      */
     int Write(uint32_t Address, uint32_t Size, uint8_t *buffer)
     {
-        int res;
         Address -= QSPI_BASE;
         // watchdog::refresh();
-        qspi_driver drv(QUADSPI);
-        FLASH_CLASS flash(drv);
-        drv.deinit();
-        Board::gpio_deinit();
-        Board::gpio_init();
-        drv.init(qspi_init);
-        res = flash.init();
-        if (res != 0)
+        flash_session session;
+        if (session.indirect() != 0)
         {
             return LOADER_FAIL;
         }
-        const auto pg_offset = Address % flash.get_pg();
-        if (pg_offset != 0 && Size > flash.get_pg())
+        /* a packed image is decoded and programmed at the offset stored in its header */
+        if (unpacker.active() || lz4_stream<>::is_stream(buffer, Size))
         {
-            if (flash.program_page(reinterpret_cast<void *>(Address), flash.get_pg() - pg_offset, buffer) != 0)
+            if (!unpacker.active())
             {
-                return LOADER_FAIL;
+                /* the manifest sector is not part of the device */
+                unpacker.reset(device_size);
+                if (flash_manifest::enabled)
+                {
+                    /* the decoder erases its destination itself: pending erases go first, the
+                       destination is unknown to the manifest before anything is decoded */
+                    flash_manifest manifest(session);
+                    constexpr uint32_t hdr = lz4_stream<>::header_size;
+                    if ((manifest.commit() != 0) || (session.indirect() != 0) ||
+                        (unpacker.feed(session.flash(), buffer, hdr) != 0) ||
+                        (manifest.forget(unpacker.origin(), unpacker.size()) != 0) || (session.indirect() != 0))
+                    {
+                        unpacker.reset();
+                        return LOADER_FAIL;
+                    }
+                    buffer += hdr;
+                    Size -= hdr;
+                }
             }
-            buffer += flash.get_pg() - pg_offset;
-            Address += flash.get_pg() - pg_offset;
-            Size -= flash.get_pg() - pg_offset;
-        }
-        auto num_pages = Size / flash.get_pg();
-        while (num_pages > 0)
-        {
-            if (flash.program_page(reinterpret_cast<void *>(Address), flash.get_pg(), buffer) != 0)
+            if (unpacker.feed(session.flash(), buffer, Size) != 0)
             {
+                unpacker.reset();
+                session.invalidate();
                 return LOADER_FAIL;
             }
-            buffer += flash.get_pg();
-            Address += flash.get_pg();
-            num_pages -= 1;
-            Size -= flash.get_pg();
-        }
-        if (Size > 0)
-        {
-            if (flash.program_page(reinterpret_cast<void *>(Address), Size, buffer) != 0)
+            if (unpacker.active())
             {
+                /* the last page program runs while the next chunk is transferred */
+                session.defer();
+            }
+            else if (unpacker.finish(session.flash()) != 0)
+            {
+                session.invalidate();
                 return LOADER_FAIL;
             }
+            return LOADER_OK;
+        }
+        if (flash_manifest::enabled)
+        {
+            return (flash_manifest(session).program(Address, Size, buffer) == 0) ? LOADER_OK : LOADER_FAIL;
+        }
+        if (session.flash().program(reinterpret_cast<void *>(Address), Size, buffer, !deferred_completion) != 0)
+        {
+            session.invalidate();
+            return LOADER_FAIL;
+        }
+        if (deferred_completion)
+        {
+            /* the next buffer is transferred while the last page is programmed */
+            session.defer();
         }
         return LOADER_OK;
     }
@@ -116,27 +143,37 @@ extern "C"
         EraseStartAddress -= QSPI_BASE;
         EraseEndAddress -= QSPI_BASE;
         // watchdog::refresh();
-        qspi_driver drv(QUADSPI);
-        FLASH_CLASS flash(drv);
-        int res;
-        drv.deinit();
-        Board::gpio_deinit();
-        Board::gpio_init();
-        drv.init(qspi_init);
-        res = flash.init();
-        if (res != 0)
+        flash_session session;
+        if (session.indirect() != 0)
         {
             return LOADER_FAIL;
         }
+        auto &flash = session.flash();
+        /* 4KB or 64KB, as advertised in Dev_Inf.cpp */
+        EraseStartAddress &= ~(sector_size_at(EraseStartAddress) - 1);
+        /* no UnInit follows: the range is erased before returning */
         while (EraseEndAddress >= EraseStartAddress)
         {
             void *addr = reinterpret_cast<void *>(EraseStartAddress);
-            res = flash.erase_sector(addr);
-            if (res != 0)
+            const uint32_t size = sector_size_at(EraseStartAddress);
+            if (flash_manifest::enabled)
+            {
+                /* the manifest skips units known to be blank */
+                if (flash_manifest(session).erase(EraseStartAddress, size) != 0)
+                {
+                    return LOADER_FAIL;
+                }
+            }
+            else if (flash.erase(addr, size) != 0)
             {
+                session.invalidate();
                 return LOADER_FAIL;
             }
-            EraseStartAddress += flash.get_sect_size();
+            EraseStartAddress += size;
+        }
+        if (flash_manifest::enabled && (flash_manifest(session).commit() != 0))
+        {
+            return LOADER_FAIL;
         }
         return LOADER_OK;
     }
@@ -154,26 +191,15 @@ extern "C"
     int MassErase(void)
     {
         // watchdog::refresh();
-        qspi_driver drv(QUADSPI);
-        FLASH_CLASS flash(drv);
-        int res;
-        // res = flash.abort();
-        // if (res != 0)
-        // {
-        //     return LOADER_FAIL;
-        // }
-        drv.deinit();
-        Board::gpio_deinit();
-        Board::gpio_init();
-        drv.init(qspi_init);
-        res = flash.init();
-        if (res != 0)
+        flash_session session;
+        if (session.indirect() != 0)
         {
             return LOADER_FAIL;
         }
-        res = flash.erase_chip();
-        if (res != 0)
+        flash_manifest(session).drop();
+        if (session.flash().erase_chip() != 0)
         {
+            session.invalidate();
             return LOADER_FAIL;
         }
         return LOADER_OK;
@@ -277,11 +303,19 @@ extern "C"
     Verify(uint32_t MemoryAddr, uint32_t RAMBufferAddr, uint32_t Size, uint32_t missalignement)
     {
         // watchdog::refresh();
-        qspi_driver drv(QUADSPI);
-        FLASH_CLASS flash(drv);
+        flash_session session;
         uint32_t VerifiedData = 0, InitVal = 0;
         uint64_t checksum;
         Size *= 4;
+        if (flash_manifest::enabled && (flash_manifest(session).commit() != 0))
+        {
+            return MemoryAddr;
+        }
+        /* Write and erase leave the driver in indirect mode */
+        if (session.mapped() != 0)
+        {
+            return MemoryAddr;
+        }
 
         checksum = CheckSum((uint32_t)MemoryAddr + (missalignement & 0xf),
                             Size - ((missalignement >> 16) & 0xF), InitVal);
@@ -1,6 +1,8 @@
 #include "Config.hpp"
 #include <array>
 #include "Board.hpp"
+#include "mpu.hpp"
+#include "overlay.hpp"
 extern "C"
 {
     int main();
@@ -9,6 +11,16 @@ __attribute__((section("external"))) int do_math(int a, int b)
 {
     return a + b;
 }
+/* stored in the flash as well, run from ITCM: copied at boot */
+__attribute__((section(".itcm"))) int do_math_itcm(int a, int b)
+{
+    return a * b;
+}
+/* loaded on demand into the shared overlay slot */
+__attribute__((section(".overlay0"))) int do_math_overlay(int a, int b)
+{
+    return a - b;
+}
 
 int main()
 {
@@ -23,17 +35,23 @@ int main()
     Board::gpio_deinit();
     Board::gpio_init();
     drv.init(qspi_init);
+    FLASH_CLASS::scheduler::configure(Board::get_clk(), flash_clk);
+    FLASH_CLASS::set_stale_word(manifest_stale_word);
     int res = flash.init();
     if (res != 0)
     {
         while (1)
             ;
     }
-    if (flash.mmap() != 0)
+    /* cached, nothing past the flash is reachable */
+    mpu::config_qspi();
+    if ((flash.mmap() != 0) || (overlay::init() != 0))
     {
         while (1)
             ;
     }
+    volatile int sink = do_math(1, 2) + do_math_itcm(3, 4) + overlay::call<0>(do_math_overlay, 5, 6);
+    (void)sink;
     while (1)
     {
         __NOP();
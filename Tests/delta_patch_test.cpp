@@ -0,0 +1,143 @@
+#include <cstring>
+#include "host.hpp"
+#include "ram_flash.hpp"
+#include "delta_patch.hpp"
+
+/*
+ * Tools/deltagen.py patches applied by delta_patch on the RAM flash: the new
+ * image must come out byte for byte, blank pages must not be programmed, a
+ * patch that is damaged or does not produce its CRC must fail.
+ * argv: python, Tools/deltagen.py
+ */
+using flash_t = ram_flash<>;
+constexpr uint32_t old_off = 0x00000;
+constexpr uint32_t patch_off = 0x40000;
+constexpr uint32_t new_off = 0x80000;
+
+static std::vector<uint8_t> make_patch(char **argv, const std::vector<uint8_t> &old_img,
+                                       const std::vector<uint8_t> &new_img)
+{
+    const auto old_path = temp_path("delta_patch", "old.bin");
+    const auto new_path = temp_path("delta_patch", "new.bin");
+    const auto out = temp_path("delta_patch", "update.patch");
+    if (!write_file(old_path, old_img) || !write_file(new_path, new_img) ||
+        !run_tool(argv, "\"" + old_path + "\" \"" + new_path + "\" \"" + out + "\""))
+    {
+        return {};
+    }
+    return read_file(out);
+}
+
+static void put(flash_t &flash, uint32_t off, const std::vector<uint8_t> &data)
+{
+    CHECK(flash.program(reinterpret_cast<void *>(static_cast<uintptr_t>(off)), static_cast<uint32_t>(data.size()),
+                        const_cast<uint8_t *>(data.data())) == 0);
+}
+
+static uint32_t le32(const std::vector<uint8_t> &buf, uint32_t pos)
+{
+    uint32_t v;
+    memcpy(&v, &buf[pos], sizeof(v));
+    return v;
+}
+
+static void set_le32(std::vector<uint8_t> &buf, uint32_t pos, uint32_t v) { memcpy(&buf[pos], &v, sizeof(v)); }
+
+/**
+ * @brief old image and patch in the flash, junk in the target slot, then apply
+ */
+static int run(flash_t &flash, const std::vector<uint8_t> &old_img, const std::vector<uint8_t> &patch,
+               delta_patch<flash_t> &applier)
+{
+    put(flash, old_off, old_img);
+    put(flash, patch_off, patch);
+    put(flash, new_off + 0x1000, std::vector<uint8_t>(0x800, 0x00));
+    return applier.apply(old_off, patch_off, static_cast<uint32_t>(patch.size()), new_off);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        std::fprintf(stderr, "usage: %s python deltagen.py\n", argv[0]);
+        return 2;
+    }
+    const auto old_img = make_image(40 * 1024, 11);
+    /* moved ranges, a range copied twice (overlapping sources), blank pages, new bytes */
+    std::vector<uint8_t> new_img(old_img.begin() + 1000, old_img.begin() + 9000);
+    new_img.insert(new_img.end(), old_img.begin() + 500, old_img.begin() + 6000);
+    new_img.resize(0x4000, 0xFF);
+    new_img.resize(0x4000 + 3 * flash_t::get_pg() + 100, 0xFF);
+    const auto fresh = make_image(3000, 12);
+    new_img.insert(new_img.end(), fresh.begin(), fresh.end());
+    new_img.insert(new_img.end(), old_img.begin() + 20000, old_img.begin() + 30000);
+    const auto patch = make_patch(argv, old_img, new_img);
+    CHECK(patch.size() > delta_patch<flash_t>::header_size);
+    uint32_t data_pages = 0;
+    for (uint32_t p = 0; p < new_img.size(); p += flash_t::get_pg())
+    {
+        bool blank = true;
+        for (uint32_t i = p; (i < p + flash_t::get_pg()) && (i < new_img.size()); i++)
+        {
+            blank = blank && (new_img[i] == 0xFF);
+        }
+        data_pages += blank ? 0 : 1;
+    }
+
+    {
+        flash_t flash;
+        delta_patch<flash_t> applier(flash);
+        CHECK(run(flash, old_img, patch, applier) == 0);
+        CHECK(memcmp(flash.data() + new_off, new_img.data(), new_img.size()) == 0);
+        /* blank pages are skipped, the junk in the slot was erased */
+        CHECK(applier.programs() == data_pages);
+        CHECK(!flash_t::is_mapped());
+        CHECK(flash.stats().errors == 0);
+    }
+
+    /* consistent header with a CRC the ops do not produce */
+    {
+        auto bad = patch;
+        const uint32_t crc = le32(bad, 12) ^ 1;
+        set_le32(bad, 12, crc);
+        set_le32(bad, 16, ~(delta_patch<flash_t>::magic ^ le32(bad, 4) ^ le32(bad, 8) ^ crc));
+        flash_t flash;
+        delta_patch<flash_t> applier(flash);
+        CHECK(run(flash, old_img, bad, applier) != 0);
+        CHECK(!flash_t::is_mapped());
+    }
+
+    /* damaged header, unknown op, truncated ops, a slot overlapping the old image */
+    {
+        auto bad = patch;
+        bad[17] ^= 0x40;
+        flash_t flash;
+        delta_patch<flash_t> applier(flash);
+        CHECK(run(flash, old_img, bad, applier) != 0);
+        CHECK(applier.programs() == 0);
+    }
+    {
+        auto bad = patch;
+        bad[delta_patch<flash_t>::header_size] = 0x7F;
+        flash_t flash;
+        delta_patch<flash_t> applier(flash);
+        CHECK(run(flash, old_img, bad, applier) != 0);
+    }
+    {
+        auto bad = patch;
+        bad.resize(bad.size() - 5);
+        flash_t flash;
+        delta_patch<flash_t> applier(flash);
+        CHECK(run(flash, old_img, bad, applier) != 0);
+    }
+    {
+        flash_t flash;
+        delta_patch<flash_t> applier(flash);
+        put(flash, old_off, old_img);
+        put(flash, patch_off, patch);
+        CHECK(applier.apply(old_off, patch_off, static_cast<uint32_t>(patch.size()), 0x8000) != 0);
+        CHECK(memcmp(flash.data() + old_off, old_img.data(), old_img.size()) == 0);
+        CHECK(!flash_t::is_mapped());
+    }
+    return (host_failures == 0) ? 0 : 1;
+}
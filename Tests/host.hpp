@@ -0,0 +1,92 @@
+#ifndef HOST_HPP
+#define HOST_HPP
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+/*
+ * Helpers of the host tests: each test is a plain executable, run by meson test
+ * with the python interpreter and the tool it feeds from as arguments. A
+ * failed CHECK prints the condition and makes the test fail.
+ */
+inline int host_failures = 0;
+
+#define CHECK(cond)                                                             \
+    do                                                                          \
+    {                                                                           \
+        if (!(cond))                                                            \
+        {                                                                       \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            host_failures++;                                                    \
+        }                                                                       \
+    } while (0)
+
+inline std::vector<uint8_t> read_file(const std::string &path)
+{
+    std::vector<uint8_t> out;
+    if (FILE *f = std::fopen(path.c_str(), "rb"))
+    {
+        int c;
+        while ((c = std::fgetc(f)) != EOF)
+        {
+            out.push_back(static_cast<uint8_t>(c));
+        }
+        std::fclose(f);
+    }
+    return out;
+}
+
+inline bool write_file(const std::string &path, const std::vector<uint8_t> &data)
+{
+    FILE *f = std::fopen(path.c_str(), "wb");
+    if (f == nullptr)
+    {
+        return false;
+    }
+    const bool ok = std::fwrite(data.data(), 1, data.size(), f) == data.size();
+    return (std::fclose(f) == 0) && ok;
+}
+
+/**
+ * @brief run a python tool of Tools/, argv of the test: python, tool
+ */
+inline bool run_tool(char **argv, const std::string &args)
+{
+    const std::string cmd = std::string("\"") + argv[1] + "\" \"" + argv[2] + "\" " + args;
+    return std::system(cmd.c_str()) == 0;
+}
+
+/**
+ * @brief file name in the temporary directory, unique per test
+ */
+inline std::string temp_path(const char *test, const char *name)
+{
+    const char *dir = std::getenv("TMPDIR");
+    return std::string((dir != nullptr) ? dir : "/tmp") + "/" + test + "_" + name;
+}
+
+/**
+ * @brief pseudo random image with runs, compressible like firmware
+ */
+inline std::vector<uint8_t> make_image(uint32_t size, uint32_t seed)
+{
+    std::vector<uint8_t> out(size);
+    uint32_t x = seed;
+    for (uint32_t i = 0; i < size;)
+    {
+        x = x * 1664525UL + 1013904223UL;
+        const uint32_t run = 1 + ((x >> 8) % 24);
+        const uint8_t val = static_cast<uint8_t>(x >> 24);
+        const bool literal = ((x >> 4) & 3) == 0;
+        for (uint32_t n = 0; (n < run) && (i < size); n++, i++)
+        {
+            out[i] = literal ? static_cast<uint8_t>(val + n * 37) : val;
+        }
+    }
+    return out;
+}
+
+#endif
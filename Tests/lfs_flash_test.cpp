@@ -0,0 +1,88 @@
+#include <cstring>
+#include "host.hpp"
+#include "ram_flash.hpp"
+#include "lfs_flash.hpp"
+
+/*
+ * littlefs on lfs_flash over the RAM flash: format, mount, write, read back,
+ * remount and read again, overwrite. Reads go through the window at QSPI_BASE
+ * like on the target.
+ */
+using flash_t = ram_flash<>;
+constexpr uint32_t fs_start = 0x10000;
+constexpr uint32_t fs_size = 32 * flash_t::get_subsect_size();
+
+static uint8_t file_buf[flash_t::get_pg()];
+
+static int store(lfs_t &lfs, const char *name, const std::vector<uint8_t> &data, uint32_t chunk)
+{
+    lfs_file_t file;
+    const struct lfs_file_config cfg = {file_buf, nullptr, 0};
+    int res = lfs_file_opencfg(&lfs, &file, name, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC, &cfg);
+    for (uint32_t pos = 0; (res == 0) && (pos < data.size()); pos += chunk)
+    {
+        const uint32_t len = (chunk < data.size() - pos) ? chunk : static_cast<uint32_t>(data.size() - pos);
+        res = (lfs_file_write(&lfs, &file, &data[pos], len) == static_cast<lfs_ssize_t>(len)) ? 0 : 1;
+    }
+    return (lfs_file_close(&lfs, &file) != 0) ? 1 : res;
+}
+
+static std::vector<uint8_t> load(lfs_t &lfs, const char *name)
+{
+    lfs_file_t file;
+    const struct lfs_file_config cfg = {file_buf, nullptr, 0};
+    std::vector<uint8_t> out;
+    if (lfs_file_opencfg(&lfs, &file, name, LFS_O_RDONLY, &cfg) != 0)
+    {
+        return out;
+    }
+    uint8_t chunk[100];
+    lfs_ssize_t got;
+    while ((got = lfs_file_read(&lfs, &file, chunk, sizeof(chunk))) > 0)
+    {
+        out.insert(out.end(), chunk, chunk + got);
+    }
+    lfs_file_close(&lfs, &file);
+    return out;
+}
+
+int main()
+{
+    flash_t flash;
+    static lfs_flash<flash_t> dev(flash, fs_start, fs_size);
+    static lfs_t lfs;
+    const auto big = make_image(3 * flash_t::get_subsect_size() + 77, 3);
+    const auto small = make_image(200, 4);
+
+    CHECK(lfs_format(&lfs, dev.config()) == 0);
+    CHECK(lfs_mount(&lfs, dev.config()) == 0);
+    CHECK(store(lfs, "big", big, 333) == 0);
+    CHECK(store(lfs, "small", small, 64) == 0);
+    CHECK(load(lfs, "big") == big);
+    CHECK(load(lfs, "small") == small);
+    CHECK(lfs_unmount(&lfs) == 0);
+
+    /* a fresh mount only sees what reached the flash */
+    CHECK(lfs_mount(&lfs, dev.config()) == 0);
+    CHECK(load(lfs, "big") == big);
+    CHECK(load(lfs, "small") == small);
+    const auto other = make_image(5000, 5);
+    CHECK(store(lfs, "small", other, 1000) == 0);
+    CHECK(lfs_unmount(&lfs) == 0);
+    CHECK(lfs_mount(&lfs, dev.config()) == 0);
+    CHECK(load(lfs, "small") == other);
+    CHECK(load(lfs, "big") == big);
+    CHECK(lfs_unmount(&lfs) == 0);
+
+    /* nothing outside the region was touched, the driver is left in indirect mode */
+    bool untouched = true;
+    for (uint32_t i = 0; i < flash_t::get_size(); i++)
+    {
+        untouched = untouched && (((i >= fs_start) && (i < fs_start + fs_size)) || (flash.data()[i] == 0xFF));
+    }
+    CHECK(untouched);
+    CHECK(dev.release() == 0);
+    CHECK(!flash_t::is_mapped());
+    CHECK(flash.stats().errors == 0);
+    return (host_failures == 0) ? 0 : 1;
+}
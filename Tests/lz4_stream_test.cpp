@@ -0,0 +1,108 @@
+#include <cstring>
+#include "host.hpp"
+#include "ram_flash.hpp"
+#include "lz4_stream.hpp"
+
+/*
+ * Tools/lz4pack.py output through lz4_stream into the RAM flash, the decoded
+ * bytes must equal the image. argv: python, Tools/lz4pack.py
+ */
+using flash_t = ram_flash<>;
+
+static std::vector<uint8_t> pack(char **argv, const std::vector<uint8_t> &image, uint32_t offset)
+{
+    const auto in = temp_path("lz4_stream", "image.bin");
+    const auto out = temp_path("lz4_stream", "image.lz4");
+    if (!write_file(in, image) || !run_tool(argv, "\"" + in + "\" \"" + out + "\" --offset " + std::to_string(offset)))
+    {
+        return {};
+    }
+    return read_file(out);
+}
+
+static std::vector<uint8_t> header(uint32_t offset, uint32_t size)
+{
+    const uint32_t words[4] = {lz4_stream<>::magic, offset, size, ~(lz4_stream<>::magic ^ offset ^ size)};
+    std::vector<uint8_t> out(sizeof(words));
+    memcpy(out.data(), words, sizeof(words));
+    return out;
+}
+
+/**
+ * @brief feed the stream in chunks of varying size, as the programmer hands them over
+ */
+static int feed(lz4_stream<> &unpacker, flash_t &flash, const std::vector<uint8_t> &stream, uint32_t chunk)
+{
+    for (uint32_t pos = 0; pos < stream.size();)
+    {
+        uint32_t len = chunk + (pos % 7);
+        if (len > stream.size() - pos)
+        {
+            len = static_cast<uint32_t>(stream.size()) - pos;
+        }
+        if (unpacker.feed(flash, &stream[pos], len) != 0)
+        {
+            return 1;
+        }
+        pos += len;
+    }
+    return unpacker.finish(flash);
+}
+
+static void check_image(char **argv, const std::vector<uint8_t> &image, uint32_t offset, uint32_t chunk)
+{
+    flash_t flash;
+    /* stale content the decoder has to erase ahead */
+    std::vector<uint8_t> junk(0x3000, 0x5A);
+    CHECK(flash.program(reinterpret_cast<void *>(static_cast<uintptr_t>(offset)), junk.size(), junk.data()) == 0);
+    const auto stream = pack(argv, image, offset);
+    CHECK(lz4_stream<>::is_stream(stream.data(), static_cast<uint32_t>(stream.size())));
+    static lz4_stream<> unpacker;
+    unpacker.reset(flash_t::get_size());
+    CHECK(feed(unpacker, flash, stream, chunk) == 0);
+    CHECK(unpacker.done());
+    CHECK(unpacker.origin() == offset);
+    CHECK(unpacker.size() == image.size());
+    CHECK(memcmp(flash.data() + offset, image.data(), image.size()) == 0);
+    CHECK(flash.stats().errors == 0);
+}
+
+static void check_rejected(uint32_t offset, uint32_t size, uint32_t limit)
+{
+    flash_t flash;
+    static lz4_stream<> unpacker;
+    unpacker.reset(limit);
+    const auto hdr = header(offset, size);
+    CHECK(unpacker.feed(flash, hdr.data(), static_cast<uint32_t>(hdr.size())) != 0);
+    CHECK(!unpacker.active());
+    CHECK(flash.stats().page_programs == 0);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        std::fprintf(stderr, "usage: %s python lz4pack.py\n", argv[0]);
+        return 2;
+    }
+    /* compressible, with a short last block */
+    check_image(argv, make_image(5 * 0x1000 + 0x123, 1), 0x10000, 61);
+    check_image(argv, make_image(3 * 0x1000, 2), 0, 4096);
+    /* incompressible: stored blocks */
+    std::vector<uint8_t> noise(2 * 0x1000 + 17);
+    uint32_t x = 7;
+    for (auto &b : noise)
+    {
+        x = x * 1103515245UL + 12345UL;
+        b = static_cast<uint8_t>(x >> 16);
+    }
+    check_image(argv, noise, 0x20000, 1000);
+
+    /* the image must fit below the flash size and the limit, without wrapping */
+    check_rejected(flash_t::get_size() - 0x1000, 0x1001, 0xFFFFFFFF);
+    check_rejected(0x1F0000, 0x8000, 0x1F4000);
+    check_rejected(0xFFFFF000, 0x2000, 0xFFFFFFFF);
+    check_rejected(0x1000, 0xFFFFF000, 0xFFFFFFFF);
+    check_rejected(0x0800, 0x100, 0xFFFFFFFF);
+    return (host_failures == 0) ? 0 : 1;
+}
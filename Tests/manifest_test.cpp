@@ -0,0 +1,163 @@
+#include <cstring>
+#include "host.hpp"
+#include "ram_flash.hpp"
+
+/*
+ * The loader manifest (Src/Config/Manifest.hpp) on the RAM flash, driven with
+ * the call sequences of the FLM hosts: a second identical download skips its
+ * units, a changed unit is programmed, erases of a separate erase session and
+ * whole units programmed onto them record the hashes a later session skips on.
+ *
+ * Config.hpp and Session.hpp of the firmware are replaced by the stand-ins
+ * below, their include guards keep Manifest.hpp from pulling the real ones.
+ */
+#define __CONFIG_HPP
+#define __SESSION_HPP
+
+using FLASH_CLASS = ram_flash<>;
+constexpr uint32_t flash_size = FLASH_CLASS::get_size();
+constexpr uint32_t sector_size = FLASH_CLASS::get_sect_size();
+constexpr uint32_t subsector_size = FLASH_CLASS::get_subsect_size();
+constexpr uint32_t pg_size = FLASH_CLASS::get_pg();
+constexpr uint32_t manifest_size = sector_size;
+constexpr uint32_t manifest_start = flash_size - manifest_size;
+constexpr uint32_t device_size = manifest_start;
+constexpr bool deferred_completion = true;
+
+/**
+ * @brief the loader session: mode switches and deferred completion, no bring up
+ */
+class flash_session
+{
+public:
+    static inline FLASH_CLASS *host_flash = nullptr;
+
+    int indirect()
+    {
+        const auto res = settle();
+        return (res != 0) ? res : host_flash->ensure_indirect();
+    }
+    int mapped()
+    {
+        const auto res = settle();
+        return (res != 0) ? res : host_flash->ensure_mapped();
+    }
+    void defer() { _pending = true; }
+    int settle()
+    {
+        if (!_pending)
+        {
+            return 0;
+        }
+        _pending = false;
+        return host_flash->wait_ready();
+    }
+    void invalidate() { invalidated++; }
+    FLASH_CLASS &flash() { return *host_flash; }
+
+    static inline uint32_t invalidated = 0;
+
+private:
+    static inline bool _pending = false;
+};
+
+#include "Manifest.hpp"
+
+enum
+{
+    ERASE = 1,
+    PROGRAM = 2
+};
+
+struct download_t
+{
+    uint32_t page_programs;
+    uint32_t erases;
+    flash_manifest::stats_t stats;
+};
+
+/**
+ * @brief one FLM operation: Init(fnc), the sector erases and pages, UnInit
+ *
+ * A fresh loader load (RAM lost) is modelled by dropping the table at Init,
+ * as FlashPrg.cpp does.
+ */
+static void session(uint32_t fnc, const std::vector<uint8_t> &image, bool erase, bool program)
+{
+    flash_session s;
+    flash_manifest manifest(s);
+    CHECK(manifest.commit() == 0);
+    manifest.drop();
+    for (uint32_t off = 0; erase && (off < image.size()); off += sector_size)
+    {
+        CHECK(manifest.erase(off, sector_size) == 0);
+        if (fnc != PROGRAM)
+        {
+            CHECK(manifest.commit() == 0);
+        }
+    }
+    for (uint32_t off = 0; program && (off < image.size()); off += subsector_size)
+    {
+        CHECK(manifest.program(off, subsector_size, &image[off]) == 0);
+    }
+    CHECK(manifest.commit() == 0);
+    CHECK(s.settle() == 0);
+}
+
+static download_t download(FLASH_CLASS &flash, const std::vector<uint8_t> &image, bool separate_erase)
+{
+    const auto before = flash.stats();
+    if (separate_erase)
+    {
+        /* Keil, pyOCD: erase under Init(1), then program under Init(2) */
+        session(ERASE, image, true, false);
+        session(PROGRAM, image, false, true);
+    }
+    else
+    {
+        session(PROGRAM, image, true, true);
+    }
+    CHECK(memcmp(flash.data(), image.data(), image.size()) == 0);
+    return {flash.stats().page_programs - before.page_programs, flash.stats().erases - before.erases,
+            flash_manifest::stats()};
+}
+
+int main()
+{
+    FLASH_CLASS flash;
+    flash_session::host_flash = &flash;
+    constexpr uint32_t units = 2 * sector_size / subsector_size;
+    auto image = make_image(2 * sector_size, 21);
+
+    /* first download compares with the blank flash and records the hashes */
+    auto first = download(flash, image, false);
+    CHECK(first.stats.compared == units);
+    CHECK(first.stats.programmed == units);
+
+    /* the same image again: every unit is skipped, neither erased nor programmed */
+    auto again = download(flash, image, false);
+    CHECK(again.stats.skipped == units);
+    CHECK(again.stats.compared == 0);
+    CHECK(again.page_programs == 0);
+    CHECK(again.erases == 0);
+
+    /* one unit changed: only that one is erased and programmed */
+    image[3 * subsector_size + 5] ^= 0x5A;
+    auto changed = download(flash, image, false);
+    CHECK(changed.stats.skipped == units - 1);
+    CHECK(changed.stats.programmed == 1);
+    CHECK(changed.erases == 1);
+
+    /* a separate erase session records blank units, whole units programmed onto them get
+       their hash: the next program session skips without reading the flash back */
+    auto other = make_image(2 * sector_size, 22);
+    download(flash, other, true);
+    auto skipped = download(flash, other, false);
+    CHECK(skipped.stats.skipped == units);
+    CHECK(skipped.stats.compared == 0);
+    CHECK(skipped.page_programs == 0);
+
+    CHECK(flash_session::invalidated == 0);
+    CHECK(flash.stats().errors == 0);
+    return (host_failures == 0) ? 0 : 1;
+}
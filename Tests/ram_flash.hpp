@@ -0,0 +1,247 @@
+#ifndef RAM_FLASH_HPP
+#define RAM_FLASH_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <cstdio>
+#include <cstdlib>
+#include "stm32h7xx.h"
+#include "QspiFlash.hpp"
+
+/**
+ * @brief RAM-backed stand-in for the flash driver, for the host tests
+ *
+ * The content lives at QSPI_BASE, so the services read it through the same
+ * window address as on the target. NOR rules apply: programming only clears
+ * bits, a page program must not cross a page, erase sets a whole unit to 0xFF.
+ * Like the chip it refuses commands while a program/erase started with
+ * wait = false is running, and like the QUADSPI it refuses indirect commands
+ * while memory mapped. Every refused command counts in errors.
+ */
+template <uint32_t flash_size = 0x200000>
+class ram_flash
+{
+public:
+    static constexpr uint32_t pg_size = 0x100;
+    static constexpr uint32_t sector_size = 0x10000;
+    static constexpr uint32_t subsector_size = 0x1000;
+
+    /* worst case times (us) of the W25Q, the services size their timeouts with them */
+    struct traits_t
+    {
+        static constexpr uint32_t t_pp_max = 3000;
+        static constexpr uint32_t t_se_max = 400000;
+        static constexpr uint32_t t_be_max = 2000000;
+    };
+
+    struct stats_t
+    {
+        uint32_t page_programs;
+        uint32_t erases;
+        uint32_t errors;
+    };
+
+    ram_flash()
+    {
+        if (mem() == nullptr)
+        {
+            void *p = ::mmap(reinterpret_cast<void *>(QSPI_BASE), flash_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+            if (p != reinterpret_cast<void *>(QSPI_BASE))
+            {
+                std::perror("ram_flash: window");
+                std::exit(2);
+            }
+            mem() = static_cast<uint8_t *>(p);
+        }
+        memset(mem(), 0xFF, flash_size);
+        _mapped = false;
+    }
+
+    int init()
+    {
+        _busy = false;
+        _mapped = false;
+        return 0;
+    }
+    int program_page(void *dest, const uint32_t size, void *src, bool wait = true)
+    {
+        const qspi_driver::segment_t seg = {static_cast<const uint8_t *>(src), size};
+        return program_page(dest, &seg, 1, wait);
+    }
+    int program_page(void *dest, const qspi_driver::segment_t *segs, uint32_t count, bool wait = true)
+    {
+        uint32_t adr = offset(dest);
+        uint32_t total = 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            total += segs[i].size;
+        }
+        if (!accept() || (total > pg_size - (adr % pg_size)) || (adr + total > flash_size))
+        {
+            return refuse();
+        }
+        for (uint32_t i = 0; i < count; i++)
+        {
+            for (uint32_t b = 0; b < segs[i].size; b++)
+            {
+                mem()[adr++] &= segs[i].buf[b];
+            }
+        }
+        _stats.page_programs++;
+        _busy = !wait;
+        return 0;
+    }
+    int program(void *dest, uint32_t size, void *src, bool wait = true)
+    {
+        uint32_t adr = offset(dest);
+        uint8_t *buf = static_cast<uint8_t *>(src);
+        while (size > 0)
+        {
+            uint32_t chunk = pg_size - (adr % pg_size);
+            if (chunk > size)
+            {
+                chunk = size;
+            }
+            int res = program_page(reinterpret_cast<void *>(static_cast<uintptr_t>(adr)), chunk, buf,
+                                   wait || (chunk != size));
+            if (res != 0)
+            {
+                return res;
+            }
+            adr += chunk;
+            buf += chunk;
+            size -= chunk;
+        }
+        return 0;
+    }
+    uint32_t verify(void *dest, const uint32_t size, void *src)
+    {
+        const uint32_t adr = offset(dest);
+        if (!accept())
+        {
+            refuse();
+            return 0;
+        }
+        for (uint32_t i = 0; i < size; i++)
+        {
+            if (mem()[adr + i] != static_cast<uint8_t *>(src)[i])
+            {
+                return i;
+            }
+        }
+        return size;
+    }
+    int blank_check(void *dest, const uint32_t size, uint8_t data)
+    {
+        const uint32_t adr = offset(dest);
+        if (!accept())
+        {
+            return refuse();
+        }
+        for (uint32_t i = 0; i < size; i++)
+        {
+            if (mem()[adr + i] != data)
+            {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    int erase_sector(void *adr, bool wait = true) { return erase_unit(offset(adr), sector_size, wait); }
+    int erase_subsector(void *adr, bool wait = true) { return erase_unit(offset(adr), subsector_size, wait); }
+    int erase(void *adr, uint32_t size, bool wait = true)
+    {
+        return (size < sector_size) ? erase_subsector(adr, wait) : erase_sector(adr, wait);
+    }
+    int erase_chip() { return erase_unit(0, flash_size, true); }
+    int wait_ready()
+    {
+        _busy = false;
+        return 0;
+    }
+    /* an operation is seen running once, then it is complete */
+    int is_busy(bool &busy)
+    {
+        if (_mapped)
+        {
+            return refuse();
+        }
+        busy = _busy;
+        _busy = false;
+        return 0;
+    }
+    int read(void *dest, uint32_t size, void *buff)
+    {
+        if (!accept())
+        {
+            return refuse();
+        }
+        memcpy(buff, mem() + offset(dest), size);
+        return 0;
+    }
+    int abort()
+    {
+        _mapped = false;
+        return 0;
+    }
+    int mmap()
+    {
+        if (_busy)
+        {
+            return refuse();
+        }
+        _mapped = true;
+        return 0;
+    }
+    int ensure_mapped() { return _mapped ? 0 : mmap(); }
+    int ensure_indirect() { return _mapped ? abort() : 0; }
+    static bool is_mapped() { return _mapped; }
+    static constexpr uint32_t get_size() { return flash_size; }
+    static constexpr uint32_t get_pg() { return pg_size; }
+    static constexpr uint32_t get_sect_size() { return sector_size; }
+    static constexpr uint32_t get_subsect_size() { return subsector_size; }
+    static constexpr uint32_t get_max_clk() { return 133000000UL; }
+
+    const stats_t &stats() const { return _stats; }
+    static const uint8_t *data() { return mem(); }
+
+private:
+    static uint8_t *&mem()
+    {
+        static uint8_t *window = nullptr;
+        return window;
+    }
+
+    static uint32_t offset(void *adr) { return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(adr)); }
+
+    bool accept() const { return !_busy && !_mapped; }
+
+    int refuse()
+    {
+        _stats.errors++;
+        return 1;
+    }
+
+    int erase_unit(uint32_t adr, uint32_t unit, bool wait)
+    {
+        if (!accept() || (adr >= flash_size))
+        {
+            return refuse();
+        }
+        adr &= ~(unit - 1);
+        memset(mem() + adr, 0xFF, unit);
+        _stats.erases++;
+        _busy = !wait;
+        return 0;
+    }
+
+    bool _busy = false;
+    inline static bool _mapped = false;
+    stats_t _stats = {};
+};
+
+static_assert(QspiFlash<ram_flash<>>);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef __STM32H7xx_H
+#define __STM32H7xx_H
+
+/*
+ * Host stand-in for the CMSIS device header, only what the flash services
+ * reference. The memory mapped window is the RAM of ram_flash (ram_flash.hpp),
+ * mapped at QSPI_BASE. Peripheral registers are never touched by the tests,
+ * except RCC and the CRC unit: they are objects, the CRC unit computes the
+ * reflected CRC-32 the manifest configures.
+ */
+#include <stdint.h>
+
+#define __IO volatile
+
+typedef struct
+{
+    __IO uint32_t CR, DCR, SR, FCR, DLR, CCR, AR, ABR, DR, PSMKR, PSMAR, PIR, LPTR;
+} QUADSPI_TypeDef;
+
+typedef struct
+{
+    __IO uint32_t AHB3ENR;
+    __IO uint32_t AHB4ENR;
+} RCC_TypeDef;
+
+/* 32 bit polynomial, input reversed by word, output reversed: the zlib CRC-32 before its final inversion */
+struct CRC_TypeDef
+{
+    struct dr_t
+    {
+        uint32_t state;
+        dr_t &operator=(uint32_t word)
+        {
+            for (uint32_t i = 0; i < 4; i++)
+            {
+                state ^= (word >> (8 * i)) & 0xFF;
+                for (uint32_t b = 0; b < 8; b++)
+                {
+                    state = (state >> 1) ^ (0xEDB88320UL & (0UL - (state & 1)));
+                }
+            }
+            return *this;
+        }
+        operator uint32_t() const { return state; }
+    };
+    struct cr_t
+    {
+        dr_t &dr;
+        const uint32_t &init;
+        cr_t &operator=(uint32_t val)
+        {
+            if ((val & 1) != 0)
+            {
+                dr.state = init;
+            }
+            return *this;
+        }
+    };
+    dr_t DR = {0};
+    uint32_t INIT = 0xFFFFFFFF;
+    uint32_t POL = 0x04C11DB7;
+    cr_t CR = {DR, INIT};
+};
+
+inline RCC_TypeDef host_rcc;
+inline CRC_TypeDef host_crc;
+
+#define QSPI_BASE 0x90000000UL
+#define QUADSPI ((QUADSPI_TypeDef *)0x52005000UL)
+#define RCC (&host_rcc)
+#define CRC (&host_crc)
+
+#define QUADSPI_CR_EN (1UL << 0)
+#define QUADSPI_CR_SSHIFT_Pos 4
+#define QUADSPI_CR_DFM (1UL << 6)
+#define QUADSPI_CR_FTHRES_Pos 8
+#define QUADSPI_CR_FTHRES (0x1FUL << 8)
+#define QUADSPI_CR_PRESCALER_Pos 24
+#define QUADSPI_CR_PRESCALER (0xFFUL << 24)
+#define QUADSPI_DCR_CKMODE_Pos 0
+#define QUADSPI_DCR_CKMODE (1UL << 0)
+#define QUADSPI_DCR_CSHT_Pos 8
+#define QUADSPI_DCR_CSHT (7UL << 8)
+#define QUADSPI_DCR_FSIZE_Pos 16
+#define QUADSPI_DCR_FSIZE (0x1FUL << 16)
+#define RCC_AHB3ENR_QSPIEN (1UL << 14)
+#define RCC_AHB4ENR_CRCEN (1UL << 19)
+#define CRC_CR_RESET (1UL << 0)
+#define CRC_CR_REV_IN_0 (1UL << 5)
+#define CRC_CR_REV_IN_1 (1UL << 6)
+#define CRC_CR_REV_OUT (1UL << 7)
+
+static inline void __DSB(void) {}
+static inline void __ISB(void) {}
+static inline void SCB_InvalidateDCache_by_Addr(volatile void *addr, int32_t size)
+{
+    (void)addr;
+    (void)size;
+}
+static inline void SCB_InvalidateICache_by_Addr(volatile void *addr, int32_t size)
+{
+    (void)addr;
+    (void)size;
+}
+
+#endif
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""Create a patch for the delta patch applier (Src/QSPI/delta_patch.hpp).
+
+Layout of the output:
+    header : magic "DLTQ", old size, new size, CRC-32 of the new image,
+             ~(magic ^ old size ^ new size ^ crc)
+    ops    : 0x00 COPY  <old offset> <length>
+             0x01 INSERT <length> <bytes>
+Header fields are uint32 little endian, offsets and lengths are LEB128.
+
+The device reads the old image and the patch from flash and programs the new
+image into a separate 4KB aligned slot, page by page.
+"""
+import argparse
+import struct
+import sys
+import zlib
+
+MAGIC = 0x51544C44
+COPY = 0x00
+INSERT = 0x01
+BLOCK = 8
+# a COPY costs up to 11 bytes, shorter matches are inserted
+MIN_COPY = 12
+
+
+def _varint(n):
+    out = bytearray()
+    while True:
+        b = n & 0x7F
+        n >>= 7
+        if n:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return out
+
+
+def _read_varint(data, pos):
+    val = 0
+    shift = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        val |= (b & 0x7F) << shift
+        if not b & 0x80:
+            return val, pos
+        shift += 7
+
+
+def _match_len(old, new, o, n):
+    length = 0
+    limit = min(len(old) - o, len(new) - n)
+    while length < limit and old[o + length] == new[n + length]:
+        length += 1
+    return length
+
+
+def diff(old, new):
+    """Greedy COPY/INSERT encoder, candidates from a hash of 8 byte blocks."""
+    index = {}
+    for i in range(0, len(old) - BLOCK + 1):
+        index.setdefault(old[i:i + BLOCK], []).append(i)
+    ops = bytearray()
+    literals = bytearray()
+    pos = 0
+    follow = None  # old offset continuing the previous copy
+
+    def flush_literals():
+        if literals:
+            ops.extend(bytes([INSERT]) + _varint(len(literals)) + literals)
+            literals.clear()
+
+    while pos < len(new):
+        best_len = 0
+        best_off = 0
+        candidates = index.get(bytes(new[pos:pos + BLOCK]), [])[-16:]
+        if follow is not None and follow < len(old):
+            candidates = [follow] + candidates
+        for off in candidates:
+            length = _match_len(old, new, off, pos)
+            if length > best_len:
+                best_len, best_off = length, off
+        if best_len >= MIN_COPY:
+            flush_literals()
+            ops.extend(bytes([COPY]) + _varint(best_off) + _varint(best_len))
+            pos += best_len
+            follow = best_off + best_len
+        else:
+            literals.append(new[pos])
+            pos += 1
+            if follow is not None:
+                follow += 1
+    flush_literals()
+    crc = zlib.crc32(new) & 0xFFFFFFFF
+    check = ~(MAGIC ^ len(old) ^ len(new) ^ crc) & 0xFFFFFFFF
+    return struct.pack('<IIIII', MAGIC, len(old), len(new), crc, check) + bytes(ops)
+
+
+def apply(old, patch):
+    magic, old_size, new_size, crc, check = struct.unpack_from('<IIIII', patch)
+    if magic != MAGIC or check != ~(magic ^ old_size ^ new_size ^ crc) & 0xFFFFFFFF or old_size != len(old):
+        raise ValueError('bad header')
+    out = bytearray()
+    pos = 20
+    while pos < len(patch):
+        op = patch[pos]
+        pos += 1
+        if op == COPY:
+            off, pos = _read_varint(patch, pos)
+            length, pos = _read_varint(patch, pos)
+            out += old[off:off + length]
+        elif op == INSERT:
+            length, pos = _read_varint(patch, pos)
+            out += patch[pos:pos + length]
+            pos += length
+        else:
+            raise ValueError('bad op 0x%02x' % op)
+    if len(out) != new_size or zlib.crc32(out) & 0xFFFFFFFF != crc:
+        raise ValueError('patched image does not match')
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('old', help='image currently in flash')
+    parser.add_argument('new', help='image to build')
+    parser.add_argument('output', help='patch')
+    args = parser.parse_args()
+    with open(args.old, 'rb') as f:
+        old = f.read()
+    with open(args.new, 'rb') as f:
+        new = f.read()
+    patch = diff(old, new)
+    # round trip before handing the file out
+    if apply(old, patch) != new:
+        sys.exit('round trip failed')
+    with open(args.output, 'wb') as f:
+        f.write(patch)
+    print('%d -> %d bytes patch (%.1f%%)' % (len(new), len(patch), 100.0 * len(patch) / max(len(new), 1)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""Code size of the loader entry points, to compare two builds.
+
+Build the loaders at both revisions (meson cross build), then:
+    Tools/flmsize.py before/ext_loader_flm.flm after/ext_loader_flm.flm
+    Tools/flmsize.py before/ext_loader_stldr.stldr after/ext_loader_stldr.stldr
+prints CSV: symbol, size per build and the difference. The totals are the
+text, data and bss sizes of the whole loader. The entry points are extern "C",
+whatever the driver inlines into them counts in their size.
+"""
+import argparse
+import subprocess
+import sys
+
+ENTRIES = {
+    ".flm": ["Init", "UnInit", "BlankCheck", "EraseChip", "EraseSector", "ProgramPage"],
+    ".stldr": ["Init", "Write", "SectorErase", "MassErase", "CheckSum", "Verify"],
+}
+
+
+def symbols(nm, elf):
+    out = subprocess.run([nm, "--print-size", "--defined-only", elf], check=True,
+                         capture_output=True, text=True).stdout
+    sizes = {}
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 4:
+            sizes[fields[3]] = int(fields[1], 16)
+    return sizes
+
+
+def totals(size, elf):
+    out = subprocess.run([size, "--format=berkeley", elf], check=True,
+                         capture_output=True, text=True).stdout
+    text, data, bss = out.splitlines()[1].split()[:3]
+    return {"(text)": int(text), "(data)": int(data), "(bss)": int(bss)}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("elf", nargs="+", help="loader builds to compare, first one is the baseline")
+    parser.add_argument("--nm", default="arm-none-eabi-nm")
+    parser.add_argument("--size", default="arm-none-eabi-size")
+    args = parser.parse_args()
+    suffix = args.elf[0][args.elf[0].rfind("."):]
+    if suffix not in ENTRIES:
+        sys.exit("unknown loader type %s, expected .flm or .stldr" % suffix)
+    builds = []
+    for elf in args.elf:
+        sizes = symbols(args.nm, elf)
+        sizes.update(totals(args.size, elf))
+        builds.append(sizes)
+    print(",".join(["symbol"] + args.elf + (["diff"] if len(builds) > 1 else [])))
+    for name in ENTRIES[suffix] + ["(text)", "(data)", "(bss)"]:
+        row = [b.get(name, 0) for b in builds]
+        diff = ["%+d" % (row[-1] - row[0])] if len(builds) > 1 else []
+        print(",".join([name] + [str(v) for v in row] + diff))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""Pack a binary image for the streaming LZ4 decoder (Src/QSPI/lz4_stream.hpp).
+
+Layout of the output:
+    header : magic "LZ4Q", flash offset, decoded size, ~(magic ^ offset ^ size)
+    blocks : uint32 length (bit 31 set = stored), LZ4 block data
+All fields are little endian. Every block decodes to BLOCK_SIZE bytes (the last
+one may be shorter) and only references data of the same block.
+
+Download the packed file with the STLDR at the flash offset it targets (the
+loader recognizes the header and programs the decoded image instead). The
+programmer's own verify compares the packed bytes and must be disabled.
+"""
+import argparse
+import struct
+import sys
+
+MAGIC = 0x51345A4C
+BLOCK_SIZE = 0x1000
+MIN_MATCH = 4
+# LZ4 block rules: the last 5 bytes are literals, the last match starts 12 bytes before the end
+LAST_LITERALS = 5
+MF_LIMIT = 12
+
+
+def _length(n):
+    out = bytearray()
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+    return out
+
+
+def _sequence(literals, match_len, offset):
+    lit = len(literals)
+    token = (min(lit, 15) << 4)
+    if match_len is not None:
+        token |= min(match_len - MIN_MATCH, 15)
+    out = bytearray([token])
+    if lit >= 15:
+        out += _length(lit - 15)
+    out += literals
+    if match_len is not None:
+        out += struct.pack('<H', offset)
+        if match_len - MIN_MATCH >= 15:
+            out += _length(match_len - MIN_MATCH - 15)
+    return out
+
+
+def compress_block(data):
+    """Greedy LZ4 block compressor with a single entry hash table."""
+    n = len(data)
+    out = bytearray()
+    table = {}
+    anchor = 0
+    pos = 0
+    limit = n - MF_LIMIT
+    while pos < limit:
+        key = data[pos:pos + MIN_MATCH]
+        cand = table.get(key)
+        table[key] = pos
+        if cand is None or pos - cand > 0xFFFF:
+            pos += 1
+            continue
+        length = MIN_MATCH
+        while pos + length < n - LAST_LITERALS and data[cand + length] == data[pos + length]:
+            length += 1
+        out += _sequence(data[anchor:pos], length, pos - cand)
+        pos += length
+        anchor = pos
+    out += _sequence(data[anchor:], None, 0)
+    return bytes(out)
+
+
+def decompress_block(data, size):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        token = data[i]
+        i += 1
+        lit = token >> 4
+        if lit == 15:
+            while True:
+                lit += data[i]
+                i += 1
+                if data[i - 1] != 255:
+                    break
+        out += data[i:i + lit]
+        i += lit
+        if i >= len(data):
+            break
+        offset = data[i] | (data[i + 1] << 8)
+        i += 2
+        mlen = token & 0x0F
+        if mlen == 15:
+            while True:
+                mlen += data[i]
+                i += 1
+                if data[i - 1] != 255:
+                    break
+        for _ in range(mlen + MIN_MATCH):
+            out.append(out[-offset])
+    if len(out) != size:
+        raise ValueError('block decodes to %d bytes instead of %d' % (len(out), size))
+    return bytes(out)
+
+
+def pack(image, offset):
+    if offset % 0x1000:
+        raise ValueError('flash offset must be 4KB aligned')
+    check = ~(MAGIC ^ offset ^ len(image)) & 0xFFFFFFFF
+    out = bytearray(struct.pack('<IIII', MAGIC, offset, len(image), check))
+    for start in range(0, len(image), BLOCK_SIZE):
+        raw = image[start:start + BLOCK_SIZE]
+        packed = compress_block(raw)
+        if len(packed) >= len(raw):
+            out += struct.pack('<I', len(raw) | 0x80000000) + raw
+        else:
+            out += struct.pack('<I', len(packed)) + packed
+    return bytes(out)
+
+
+def unpack(stream):
+    magic, offset, size, check = struct.unpack_from('<IIII', stream)
+    if magic != MAGIC or check != ~(magic ^ offset ^ size) & 0xFFFFFFFF:
+        raise ValueError('bad header')
+    out = bytearray()
+    pos = 16
+    while len(out) < size:
+        length, = struct.unpack_from('<I', stream, pos)
+        pos += 4
+        data = stream[pos:pos + (length & 0x7FFFFFFF)]
+        pos += len(data)
+        expected = min(BLOCK_SIZE, size - len(out))
+        out += data if length & 0x80000000 else decompress_block(data, expected)
+    return offset, bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('input', help='raw binary image')
+    parser.add_argument('output', help='packed stream')
+    parser.add_argument('--offset', type=lambda x: int(x, 0), default=0,
+                        help='flash offset the image is programmed to (default 0)')
+    args = parser.parse_args()
+    with open(args.input, 'rb') as f:
+        image = f.read()
+    stream = pack(image, args.offset)
+    # round trip before handing the file out
+    if unpack(stream) != (args.offset, image):
+        sys.exit('round trip failed')
+    with open(args.output, 'wb') as f:
+        f.write(stream)
+    print('%d -> %d bytes (%.1f%%)' % (len(image), len(stream), 100.0 * len(stream) / max(len(image), 1)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+"""Decode the result table of the XIP sweep firmware (Src/Bench/xip.hpp).
+
+Dump the table with gdb once the firmware spins in its final loop:
+    dump binary value xip.bin xip::table
+then print it as CSV:
+    Tools/xipdump.py xip.bin
+
+Layout, uint32 little endian:
+    header : magic "XIPQ", row words, rows, cpu_hz, seq bytes, random reads,
+             fetch bytes, reserved
+    rows   : presc, lptr, sioo, cache, policy, seq cycles, random cycles,
+             fetch cycles
+Bandwidths are MB/s at cpu_hz, random reads are in reads per microsecond.
+"""
+import argparse
+import struct
+import sys
+
+MAGIC = 0x51504958
+HEADER = 8
+POLICIES = ["write-through", "write-back", "non-cacheable", "default map"]
+
+
+def decode(data):
+    words = struct.unpack("<%dI" % (len(data) // 4), data[: len(data) // 4 * 4])
+    if len(words) < HEADER:
+        raise ValueError("dump too short")
+    magic, row_words, rows, cpu_hz, seq_bytes, rand_reads, fetch_bytes, _ = words[:HEADER]
+    if magic != MAGIC:
+        raise ValueError("sweep not complete (magic 0x%08x)" % magic)
+    if len(words) < HEADER + rows * row_words:
+        raise ValueError("dump holds less than %d rows" % rows)
+    out = []
+    for r in range(rows):
+        row = words[HEADER + r * row_words: HEADER + (r + 1) * row_words]
+        presc, lptr, sioo, cache, policy, seq, rand, fetch = row[:8]
+        out.append({
+            "presc": presc,
+            "lptr": lptr,
+            "sioo": sioo,
+            "cache": cache,
+            "policy": POLICIES[policy] if policy < len(POLICIES) else str(policy),
+            "seq_mbs": seq_bytes * cpu_hz / seq / 1e6 if seq else 0.0,
+            "rand_per_us": rand_reads * cpu_hz / rand / 1e6 if rand else 0.0,
+            "fetch_mbs": fetch_bytes * cpu_hz / fetch / 1e6 if fetch else 0.0,
+            "seq": seq,
+            "rand": rand,
+            "fetch": fetch,
+        })
+    return out
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("dump", help="binary dump of xip::table")
+    args = ap.parse_args()
+    with open(args.dump, "rb") as f:
+        try:
+            rows = decode(f.read())
+        except ValueError as e:
+            sys.exit("xipdump: %s" % e)
+    cols = ["presc", "lptr", "sioo", "cache", "policy", "seq_mbs", "rand_per_us", "fetch_mbs", "seq", "rand",
+            "fetch"]
+    print(",".join(cols))
+    for row in rows:
+        print(",".join(("%.2f" % row[c]) if isinstance(row[c], float) else str(row[c]) for c in cols))
+
+
+if __name__ == "__main__":
+    main()